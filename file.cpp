@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <iostream>
 #include "filex"
+#include "hash"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -25,12 +26,37 @@
 	#include <fcntl.h>
 	#include <unistd.h>
 	#include <sys/mman.h>
+	#include <cerrno>
 
 	#include <dlfcn.h> // dlopen ...
 #endif
 
+#ifdef __linux__
+	#include <sys/inotify.h>
+#endif
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define STDX_FILE_SSE2
+	#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
+#include <chrono>
+
 namespace stdx
 {
+	namespace detail
+	{
+		namespace load_file
+		{
+			size_t const block_size = 1 << 20;       // bytes per read call
+			size_t const map_threshold = 64 << 20;   // larger files are copied from a mapping
+			size_t const direct_alignment = 4096;    // offset, size & address alignment of uncached reads
+		}
+	}
+
 	long long file_time(char const* name)
 	{
 		struct stat buf = { 0 };
@@ -43,6 +69,15 @@ namespace stdx
 		return utime(name, nullptr) == 0;
 	}
 
+	bool make_directory(char const* name)
+	{
+#ifdef WIN32
+		return CreateDirectoryA(name, nullptr) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+		return mkdir(name, 0777) == 0 || errno == EEXIST;
+#endif
+	}
+
 	std::string current_directory()
 	{
 		return realpath(".");
@@ -207,39 +242,12 @@ namespace stdx
 		return relative;
 	}
 
-	std::string load_file(char const* name)
-	{
-		std::string str;
-
-		auto t = read_file(name);
-		t.seekg(0, std::ios::end);   
-		str.reserve((size_t) t.tellg());
-		t.seekg(0, std::ios::beg);
-
-		str.assign(std::istreambuf_iterator<char>(t), std::istreambuf_iterator<char>());
-		return str;
-	}
-	
-	std::vector<char> load_binary_file(char const* name, bool nullterminated)
-	{
-		std::vector<char> data;
-
-		auto t = read_binary_file(name);
-		t.seekg(0, std::ios::end);
-		size_t fileSize = (size_t) t.tellg();
-		data.resize(fileSize + (size_t) nullterminated);
-		t.seekg(0, std::ios::beg);
-
-		t.read(data.data(), fileSize);
-		return data;
-	}
-
 	module_symbol get_symbol(void* module, char const* name)
 	{
 #ifdef WIN32
 		return (void(WINAPI*)()) ::GetProcAddress((HMODULE)module, name);
 #else
-		return ::dlsym(module, name);
+		return (module_symbol) ::dlsym(module, name);
 #endif
 	}
 
@@ -335,6 +343,38 @@ namespace stdx
 			};
 
 			typedef win_delete<HANDLE, CloseHandle>::handle_type winhandle;
+
+			// reads the whole file into the given buffer, followed by the given number of zero bytes;
+			// uncached hint is ignored, unbuffered reads would require sector-aligned destinations
+			template <class Buffer>
+			void read_whole_file(char const* name, Buffer& buffer, size_t padding, unsigned hints)
+			{
+				winhandle file( ::CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING
+					, FILE_FLAG_SEQUENTIAL_SCAN, NULL) );
+				if (file.get() == INVALID_HANDLE_VALUE)
+					throwx( file_error(name) );
+
+				LONGLONG longSize;
+				if (!::GetFileSizeEx(file, reinterpret_cast<LARGE_INTEGER*>(&longSize)))
+					throwx( file_error(name) );
+				size_t fileSize = static_cast<size_t>(longSize);
+
+				buffer.resize(fileSize + padding);
+				size_t offset = 0;
+				while (offset < fileSize)
+				{
+					DWORD chunk = DWORD( min_value(fileSize - offset, detail::load_file::block_size) ), bytesRead = 0;
+					if (!::ReadFile(file, &buffer[0] + offset, chunk, &bytesRead, nullptr))
+						throwx( file_error(name) );
+					if (bytesRead == 0)
+						break;
+					offset += bytesRead;
+				}
+
+				// file shrunk in the meantime
+				if (offset < fileSize)
+					buffer.resize(offset + padding);
+			}
 		}
 	}
 
@@ -398,6 +438,10 @@ namespace stdx
 			throwx(std::runtime_error(name));
 
 		this->size = static_cast<size_t>(longSize);
+
+		// no user-mode equivalent of MAP_POPULATE, large pages require privileges
+		if (hints & (file_flags::willneed | file_flags::populate))
+			prefetchAll();
 	}
 
 	mapped_file::~mapped_file()
@@ -406,17 +450,24 @@ namespace stdx
 			::UnmapViewOfFile(data);
 	}
 
-	void mapped_file::prefetchAll()
+	void mapped_file::prefetch(size_t offset, size_t length)
 	{
+		if (offset >= size)
+			return;
 		static auto PrefetchVirtualMemory = detail::generic_file::get_prefetch_function();
 		if (PrefetchVirtualMemory)
 		{
 			static HANDLE process = GetCurrentProcess();
-			WIN32_MEMORY_RANGE_ENTRY prefetchRange = { data, size };
+			WIN32_MEMORY_RANGE_ENTRY prefetchRange = { data + offset, min_value(length, size - offset) };
 			(*PrefetchVirtualMemory)(process, 1, &prefetchRange, 0);
 		}
 	}
 
+	void mapped_file::prefetchAll()
+	{
+		prefetch(0, size);
+	}
+
 	namespace detail
 	{
 		namespace prompt_file
@@ -851,6 +902,156 @@ namespace stdx
 			};
 
 			typedef unix_delete<int, -1, close>::handle_type fdhandle;
+
+			inline int get_posix_map_flags(unsigned hints)
+			{
+				int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+				if (hints & file_flags::populate) flags |= MAP_POPULATE;
+#endif
+				return flags;
+			}
+
+			inline int get_posix_advice(unsigned hints)
+			{
+				if (hints & file_flags::sequential) return MADV_SEQUENTIAL;
+				else if (hints & file_flags::random) return MADV_RANDOM;
+				else return MADV_NORMAL;
+			}
+
+			inline size_t page_size()
+			{
+				static size_t const size = (size_t) ::sysconf(_SC_PAGESIZE);
+				return size;
+			}
+
+			inline ssize_t pread_retry(int fd, char* dest, size_t size, off_t offset)
+			{
+				ssize_t bytesRead;
+				do bytesRead = ::pread(fd, dest, size, offset);
+				while (bytesRead == -1 && errno == EINTR);
+				return bytesRead;
+			}
+			inline ssize_t read_retry(int fd, char* dest, size_t size)
+			{
+				ssize_t bytesRead;
+				do bytesRead = ::read(fd, dest, size);
+				while (bytesRead == -1 && errno == EINTR);
+				return bytesRead;
+			}
+
+			// uncached reads go through an aligned bounce buffer, returns bytes read
+			inline size_t read_direct(int fd, char* dest, size_t size)
+			{
+				struct aligned_free { void operator ()(void* p) const { free(p); } };
+				void* bounce = nullptr;
+				if (::posix_memalign(&bounce, detail::load_file::direct_alignment, detail::load_file::block_size) != 0)
+					return 0;
+				std::unique_ptr<char, aligned_free> bounceHandle((char*) bounce);
+
+				size_t offset = 0;
+				while (offset < size)
+				{
+					// whole aligned blocks, the final read stops short at end of file
+					ssize_t bytesRead = pread_retry(fd, bounceHandle.get(), detail::load_file::block_size, (off_t) offset);
+					if (bytesRead <= 0)
+						break;
+					size_t copied = min_value((size_t) bytesRead, size - offset);
+					memcpy(dest + offset, bounceHandle.get(), copied);
+					offset += copied;
+				}
+				return offset;
+			}
+
+			// large files are mapped & copied w/ sequential read-ahead, returns false if the mapping fails
+			inline bool read_mapped(int fd, char* dest, size_t size)
+			{
+				void* mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (mapping == MAP_FAILED)
+					return false;
+				::madvise(mapping, size, MADV_SEQUENTIAL);
+				memcpy(dest, mapping, size);
+				::munmap(mapping, size);
+				return true;
+			}
+
+			// reads the whole file into the given buffer, followed by the given number of zero bytes
+			template <class Buffer>
+			void read_whole_file(char const* name, Buffer& buffer, size_t padding, unsigned hints)
+			{
+				bool uncached = false;
+				fdhandle file;
+#ifdef O_DIRECT
+				// not all file systems support uncached reads
+				if (hints & file_flags::uncached)
+				{
+					file = fdhandle( ::open(name, O_RDONLY | O_CLOEXEC | O_DIRECT) );
+					uncached = (file.get() != -1);
+				}
+#endif
+				if (!uncached)
+					file = fdhandle( ::open(name, O_RDONLY | O_CLOEXEC) );
+				if (file.get() == -1)
+					throwx( file_error(name) );
+
+				struct stat st;
+				if (::fstat(file.get(), &st) != 0 || S_ISDIR(st.st_mode))
+					throwx( file_error(name) );
+				size_t fileSize = (S_ISREG(st.st_mode)) ? (size_t) st.st_size : 0;
+
+				size_t offset = 0;
+				buffer.resize(fileSize + padding);
+				if (fileSize > 0)
+				{
+					if (uncached)
+					{
+						offset = read_direct(file.get(), &buffer[0], fileSize);
+						// continue w/ buffered reads, unaligned reads are rejected on uncached descriptors
+						if (offset < fileSize)
+						{
+							file = fdhandle( ::open(name, O_RDONLY | O_CLOEXEC) );
+							if (file.get() == -1)
+								throwx( file_error(name) );
+						}
+					}
+					else if (fileSize >= detail::load_file::map_threshold && read_mapped(file.get(), &buffer[0], fileSize))
+						offset = fileSize;
+				}
+
+				// buffered reads, also for files of unknown size (pipes, procfs) & after failed uncached reads;
+				// pipes & FIFOs cannot be read at offsets and are read sequentially instead
+				bool sequential = false;
+				while (true)
+				{
+					if (offset == fileSize)
+					{
+						if (S_ISREG(st.st_mode) && fileSize > 0)
+							break;
+						// size unknown, grow until end of file
+						fileSize = max_value(2 * fileSize, page_size());
+						buffer.resize(fileSize + padding);
+					}
+
+					size_t chunk = min_value(fileSize - offset, detail::load_file::block_size);
+					ssize_t bytesRead = (sequential)
+						? read_retry(file.get(), &buffer[0] + offset, chunk)
+						: pread_retry(file.get(), &buffer[0] + offset, chunk, (off_t) offset);
+					if (bytesRead == -1 && errno == ESPIPE && !sequential)
+					{
+						sequential = true;
+						continue;
+					}
+					if (bytesRead == -1)
+						throwx( file_error(name) );
+					if (bytesRead == 0)
+						break;
+					offset += (size_t) bytesRead;
+				}
+
+				// unknown size or file shrunk in the meantime
+				if (offset < fileSize)
+					buffer.resize(offset + padding);
+			}
 		}
 	}
 
@@ -876,25 +1077,45 @@ namespace stdx
 		if ((access & file_flags::write) && size != 0)
 		{
 			mapSize = size;
-			auto success = ::lseek(file, mapSize - 1, SEEK_SET) != -1
-				&& ::write(file, "", 1) == 1;
+			auto success = ::lseek(file.get(), mapSize - 1, SEEK_SET) != -1
+				&& ::write(file.get(), "", 1) == 1;
 			if (!success)
 				throwx(std::runtime_error(name));
 		}
 		// Always map full range
 		else
-			mapSize = ::lseek(file, 0, SEEK_END);
+			mapSize = ::lseek(file.get(), 0, SEEK_END);
+
+#ifdef POSIX_FADV_SEQUENTIAL
+		// read-ahead of the page cache, independent of the mapping
+		if (hints & file_flags::sequential)
+			::posix_fadvise(file.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+		else if (hints & file_flags::random)
+			::posix_fadvise(file.get(), 0, 0, POSIX_FADV_RANDOM);
+#endif
 
-		this->data = (char*) ::mmap(nullptr
+		void* mapping = ::mmap(nullptr
 			, mapSize
 			, (access & file_flags::write) ? PROT_READ | PROT_WRITE : PROT_READ
-			, MAP_SHARED
-			, file
+			, detail::generic_file::get_posix_map_flags(hints)
+			, file.get()
 			, 0);
-		if (!this->data)
+		if (mapping == MAP_FAILED)
 			throwx(std::runtime_error(name));
 
+		this->data = (char*) mapping;
 		this->size = mapSize;
+
+		// advice is best-effort, failures leave the default paging behavior
+		int advice = detail::generic_file::get_posix_advice(hints);
+		if (advice != MADV_NORMAL)
+			::madvise(this->data, this->size, advice);
+#ifdef MADV_HUGEPAGE
+		if (hints & file_flags::huge_pages)
+			::madvise(this->data, this->size, MADV_HUGEPAGE);
+#endif
+		if (hints & file_flags::willneed)
+			prefetchAll();
 	}
 
 	mapped_file::~mapped_file()
@@ -903,8 +1124,20 @@ namespace stdx
 			::munmap(data, size);
 	}
 
+	void mapped_file::prefetch(size_t offset, size_t length)
+	{
+		if (offset >= size)
+			return;
+		length = min_value(length, size - offset);
+
+		// madvise requires page-aligned addresses, the kernel schedules read-ahead asynchronously
+		size_t pageOffset = offset - offset % detail::generic_file::page_size();
+		::madvise(data + pageOffset, length + (offset - pageOffset), MADV_WILLNEED);
+	}
+
 	void mapped_file::prefetchAll()
 	{
+		prefetch(0, size);
 	}
 
 
@@ -979,25 +1212,232 @@ namespace stdx
 	}
 
 #endif
+
+	std::string load_file(char const* name, unsigned hints)
+	{
+		std::string str;
+		detail::generic_file::read_whole_file(name, str, 0, hints);
+#ifdef WIN32
+		// text mode, as w/ the former stream-based loader
+		size_t textSize = 0;
+		for (size_t i = 0, ie = str.size(); i < ie; ++i)
+			if (str[i] != '\r' || i + 1 == ie || str[i + 1] != '\n')
+				str[textSize++] = str[i];
+		str.resize(textSize);
+#endif
+		return str;
+	}
+	
+	std::vector<char> load_binary_file(char const* name, bool nullterminated, unsigned hints)
+	{
+		std::vector<char> data;
+		detail::generic_file::read_whole_file(name, data, (size_t) nullterminated, hints);
+		return data;
+	}
+
+	file_watcher::file_watcher(unsigned pollIntervalMS, unsigned timeBudget)
+		: notify(-1)
+		, pollIntervalMS(pollIntervalMS)
+		, timeBudget(max_value(timeBudget, 1U))
+		, timeCursor(0)
+		, lastPoll(0)
+		, changes(0)
+	{
+#ifdef __linux__
+		notify = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+	}
+
+	file_watcher::~file_watcher()
+	{
+#ifdef __linux__
+		if (notify != -1)
+			::close(notify);
+#endif
+	}
+
+	file_watcher& file_watcher::shared()
+	{
+		static file_watcher watcher;
+		return watcher;
+	}
+
+	unsigned file_watcher::watch(char const* path)
+	{
+		for (size_t i = 0; i < entries.size(); ++i)
+			if (entries[i].path == path)
+				return unsigned(i);
+
+		entry e;
+		e.path = path;
+		e.directory = -1;
+		e.time = file_time(path);
+		e.generation = 0;
+#ifdef __linux__
+		if (notify != -1)
+		{
+			// watch the directory, editors frequently save by replacing the file
+			char const* separator = strrchr(path, '/');
+			std::string dir = (separator) ? std::string(path, separator + (separator == path)) : std::string(".");
+			int wd = ::inotify_add_watch(notify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ATTRIB);
+			if (wd != -1)
+			{
+				e.directory = wd;
+				e.name = (separator) ? separator + 1 : path;
+				bool known = false;
+				for (auto& d : directories)
+					known |= (d.first == wd);
+				if (!known)
+					directories.push_back( std::make_pair(wd, MOVE(dir)) );
+			}
+		}
+#endif
+		if (e.directory == -1)
+			timedEntries.push_back(unsigned(entries.size()));
+		entries.push_back(MOVE(e));
+		return unsigned(entries.size() - 1);
+	}
+
+	void file_watcher::modified(size_t id, std::vector<std::string>* changed)
+	{
+		++entries[id].generation;
+		++changes;
+		if (changed)
+			changed->push_back(entries[id].path);
+	}
+
+	size_t file_watcher::poll(std::vector<std::string>* changed)
+	{
+		long long now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+		if (now - lastPoll < (long long) pollIntervalMS)
+			return 0;
+		lastPoll = now;
+
+		unsigned long long changesBefore = changes;
+#ifdef __linux__
+		if (notify != -1)
+		{
+			alignas(inotify_event) char buffer[16 * 1024];
+			bool overflow = false;
+			while (true)
+			{
+				ssize_t bytesRead = ::read(notify, buffer, sizeof(buffer));
+				if (bytesRead <= 0)
+					break;
+				for (char* cursor = buffer; cursor < buffer + bytesRead; )
+				{
+					auto& event = *reinterpret_cast<inotify_event*>(cursor);
+					cursor += sizeof(inotify_event) + event.len;
+					overflow |= (event.mask & IN_Q_OVERFLOW) != 0;
+					if (!event.len)
+						continue;
+					for (size_t i = 0; i < entries.size(); ++i)
+						if (entries[i].directory == event.wd && entries[i].name == event.name)
+							modified(i, changed);
+				}
+			}
+
+			// events were dropped, any notified file may have changed
+			if (overflow)
+				for (size_t i = 0; i < entries.size(); ++i)
+					if (entries[i].directory != -1)
+						modified(i, changed);
+		}
+#endif
+
+		// compare times round robin for files w/o notifications
+		for (size_t i = 0, ie = min_value(timedEntries.size(), (size_t) timeBudget); i < ie; ++i)
+		{
+			timeCursor = (timeCursor + 1 < timedEntries.size()) ? timeCursor + 1 : 0;
+			unsigned id = timedEntries[timeCursor];
+			auto& e = entries[id];
+			long long time = file_time(e.path.c_str());
+			if (time != e.time)
+			{
+				e.time = time;
+				modified(id, changed);
+			}
+		}
+
+		return size_t(changes - changesBefore);
+	}
 	
 	namespace detail
 	{
 		namespace process_includes
 		{
-			inline char const* string_find(stdx::data_range_param<char const> str, char const val, char const* cursor)
+			char const directive[] = "#include";
+			size_t const directive_size = sizeof(directive) - 1;
+
+			inline unsigned count_bits(unsigned mask)
 			{
-				return std::find(cursor, str.end(), val);
+				mask = mask - ((mask >> 1) & 0x55555555);
+				mask = (mask & 0x33333333) + ((mask >> 2) & 0x33333333);
+				return (((mask + (mask >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
 			}
 
-			inline char const* string_find(stdx::data_range_param<char const> str, char const* val, char const* cursor)
+			inline unsigned lowest_bit(unsigned mask)
 			{
-				return std::search(cursor, str.end(), val, val + strlen(val));
+#ifdef _MSC_VER
+				unsigned long idx;
+				_BitScanForward(&idx, mask);
+				return unsigned(idx);
+#else
+				return unsigned(__builtin_ctz(mask));
+#endif
 			}
 
-			template <size_t Size>
-			inline char const* string_find(stdx::data_range_param<char const> str, char const (&val)[Size], char const* cursor)
+			inline bool is_directive(char const* cursor, char const* end)
 			{
-				return std::search(cursor, str.end(), val, val + Size - 1);
+				return size_t(end - cursor) >= directive_size && memcmp(cursor, directive, directive_size) == 0;
+			}
+
+			// next "#include" at or after cursor (end if none), counts the newlines skipped on the way
+			inline char const* find_directive(char const* cursor, char const* end, size_t& newlines)
+			{
+#ifdef STDX_FILE_SSE2
+				__m128i const hashes = _mm_set1_epi8('#'), breaks = _mm_set1_epi8('\n');
+				for (; end - cursor >= 16; cursor += 16)
+				{
+					__m128i block = _mm_loadu_si128(reinterpret_cast<__m128i const*>(cursor));
+					unsigned candidates = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(block, hashes)));
+					unsigned lines = unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(block, breaks)));
+					for (; candidates; candidates &= candidates - 1)
+					{
+						unsigned idx = lowest_bit(candidates);
+						if (is_directive(cursor + idx, end))
+						{
+							newlines += count_bits(lines & ((1U << idx) - 1));
+							return cursor + idx;
+						}
+					}
+					newlines += count_bits(lines);
+				}
+#endif
+				for (; cursor < end; ++cursor)
+				{
+					if (*cursor == '#' && is_directive(cursor, end))
+						return cursor;
+					newlines += (*cursor == '\n');
+				}
+				return end;
+			}
+
+			inline void append_line_directive(std::string& result, size_t line, char const* filename, bool int_file_id)
+			{
+				char buffer[64];
+				if (!int_file_id)
+				{
+					sprintf(buffer, "#line %llu \"", (unsigned long long) line);
+					result += buffer;
+					result += filename;
+					result += "\"\n";
+				}
+				else
+				{
+					sprintf(buffer, "#line %llu %d\n", (unsigned long long) line, (int) filename[0]);
+					result += buffer;
+				}
 			}
 		}
 	}
@@ -1008,9 +1448,14 @@ namespace stdx
 	{
 		using namespace detail::process_includes;
 
-		std::stringstream result;
+		std::string result;
+		// includes are appended as resolved, most sources are dominated by their own text
+		result.reserve(preamble.size() + src.size() + src.size() / 4 + 256);
 		if (!preamble.empty())
-			result << preamble << std::endl;
+		{
+			result.append(preamble.data(), preamble.size());
+			result += '\n';
+		}
 
 		char const *srcBegin = src.data(), *srcEnd = srcBegin + src.size();
 		auto nextSrcCursor = srcBegin;
@@ -1018,40 +1463,39 @@ namespace stdx
 
 		while (nextSrcCursor < srcEnd)
 		{
-			auto nextIncludeCursor = string_find(src, "#include", nextSrcCursor);
+			size_t newlines = 0;
+			auto nextIncludeCursor = find_directive(nextSrcCursor, srcEnd, newlines);
 
-			result << "#line " << nextSrcLine;
-			if (!int_file_id)
-				result << " \"" << filename << "\"\n";
-			else
-				result << " " << (int) filename[0] << "\n";
-			result.write(nextSrcCursor, nextIncludeCursor - nextSrcCursor);
+			append_line_directive(result, nextSrcLine, filename, int_file_id);
+			result.append(nextSrcCursor, nextIncludeCursor);
 
-			nextSrcLine += std::count(nextSrcCursor, nextIncludeCursor, '\n');
+			nextSrcLine += newlines;
 			nextSrcCursor = nextIncludeCursor;
 
 			if (nextIncludeCursor < srcEnd)
 			{
-				auto nextIncludeEnd = string_find(src, '\n', nextIncludeCursor);
-
-				auto localInclueStart = string_find(src, '"', nextIncludeCursor);
-				auto systemInclueStart = string_find(src, '<', nextIncludeCursor);
+				// directive ends at the line break, quoted names take precedence over angle brackets
+				auto nextIncludeEnd = nextIncludeCursor;
+				char const *localIncludeStart = nullptr, *systemIncludeStart = nullptr;
+				for (; nextIncludeEnd < srcEnd && *nextIncludeEnd != '\n'; ++nextIncludeEnd)
+				{
+					if (*nextIncludeEnd == '"' && !localIncludeStart) localIncludeStart = nextIncludeEnd;
+					if (*nextIncludeEnd == '<' && !systemIncludeStart) systemIncludeStart = nextIncludeEnd;
+				}
 
 				bool localInclude = true;
 				std::string includeName;
 
-				if (localInclueStart < nextIncludeEnd)
+				if (localIncludeStart)
+					includeName.assign(localIncludeStart + 1, std::find(localIncludeStart + 1, srcEnd, '"'));
+				else if (systemIncludeStart)
 				{
-					includeName.assign(localInclueStart + 1, string_find(src, '"', localInclueStart + 1));
-					localInclude = true;
-				}
-				else if (systemInclueStart < nextIncludeEnd)
-				{
-					includeName.assign(systemInclueStart + 1, string_find(src, '>', systemInclueStart + 1));
+					includeName.assign(systemIncludeStart + 1, std::find(systemIncludeStart + 1, srcEnd, '>'));
 					localInclude = false;
 				}
 
-				result << resolve_include.resolve(includeName.c_str(), localInclude) << '\n';
+				result += resolve_include.resolve(includeName.c_str(), localInclude);
+				result += '\n';
 
 				// Skip #include directive
 				nextSrcCursor = nextIncludeEnd;
@@ -1061,7 +1505,309 @@ namespace stdx
 			}
 		}
 
-		return result.str();
+		return result;
+	}
+
+	namespace detail
+	{
+		namespace process_includes
+		{
+			// records the includes of the file being expanded, resolving them through the cache
+			struct cached_resolver : include_resolver
+			{
+				include_cache& cache;
+				include_cache::entry& parent;
+
+				cached_resolver(include_cache& cache, include_cache::entry& parent)
+					: cache(cache), parent(parent) { }
+
+				std::string resolve(char const* filename, bool) const override
+				{
+					std::string const& expanded = cache.expand(filename);
+					parent.includes.push_back(filename);
+					parent.includeVersions.push_back(cache.version(filename));
+					return expanded;
+				}
+			};
+		}
+	}
+
+	namespace detail
+	{
+		namespace resolve_conditionals
+		{
+			typedef stdx::range<char const*> token;
+
+			inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+			inline bool is_ident(char c) { return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'); }
+
+			inline char const* skip_space(char const* cursor, char const* end)
+			{
+				while (cursor < end && is_space(*cursor)) ++cursor;
+				return cursor;
+			}
+			inline token read_ident(char const* cursor, char const* end)
+			{
+				token t(cursor, cursor);
+				while (t.last < end && is_ident(*t.last)) ++t.last;
+				return t;
+			}
+			inline bool equals(token t, char const* str)
+			{
+				auto len = strlen(str);
+				return t.size() == len && memcmp(t.first, str, len) == 0;
+			}
+			inline bool is_line_end(char const* cursor, char const* end)
+			{
+				cursor = skip_space(cursor, end);
+				return cursor == end || (cursor + 1 < end && cursor[0] == '/' && (cursor[1] == '/' || cursor[1] == '*'));
+			}
+
+			enum state
+			{
+				unknown = -1,
+				undefined = 0,
+				defined = 1
+			};
+
+			struct condition_evaluator
+			{
+				stdx::data_range_param<char const* const> defined, undefined;
+
+				state lookup(token name) const
+				{
+					for (auto m : defined) if (equals(name, m)) return state::defined;
+					for (auto m : undefined) if (equals(name, m)) return state::undefined;
+					return unknown;
+				}
+
+				// directive name given, cursor after it; only single tests of known macros can be resolved
+				state evaluate(token directive, char const* cursor, char const* end) const
+				{
+					bool negate = equals(directive, "ifndef");
+					if (!negate && !equals(directive, "ifdef"))
+					{
+						cursor = skip_space(cursor, end);
+						if (cursor < end && *cursor == '!')
+						{
+							negate = true;
+							cursor = skip_space(cursor + 1, end);
+						}
+						auto op = read_ident(cursor, end);
+						if (!equals(op, "defined"))
+							return unknown;
+						cursor = skip_space(op.last, end);
+						bool paren = cursor < end && *cursor == '(';
+						if (paren)
+						{
+							auto name = read_ident(skip_space(cursor + 1, end), end);
+							cursor = skip_space(name.last, end);
+							if (cursor == end || *cursor != ')' || !is_line_end(cursor + 1, end))
+								return unknown;
+							return apply(lookup(name), negate);
+						}
+					}
+					auto name = read_ident(skip_space(cursor, end), end);
+					if (name.empty() || !is_line_end(name.last, end))
+						return unknown;
+					return apply(lookup(name), negate);
+				}
+
+				static state apply(state s, bool negate)
+				{
+					return (s == unknown || !negate) ? s : state(!s);
+				}
+			};
+
+			struct block
+			{
+				bool resolved;      // branches are chosen here, directives stripped
+				bool taken;         // some branch already active (resolved only)
+				bool outerEmitting; // enclosing lines are kept
+				bool emitting;      // lines of the current branch are kept
+			};
+		}
+	}
+
+	std::string resolve_conditionals(stdx::data_range_param<char const> src
+		, stdx::data_range_param<char const* const> defined, stdx::data_range_param<char const* const> undefined)
+	{
+		using namespace detail::resolve_conditionals;
+		condition_evaluator evaluator = { defined, undefined };
+
+		std::string result;
+		result.reserve(src.size());
+		std::vector<block> blocks;
+
+		auto cursor = src.data(), srcEnd = src.data() + src.size();
+		while (cursor < srcEnd)
+		{
+			auto lineEnd = std::find(cursor, srcEnd, '\n');
+			auto nextLine = (lineEnd < srcEnd) ? lineEnd + 1 : lineEnd;
+			bool emitting = blocks.empty() || blocks.back().emitting;
+			bool keep = emitting;
+
+			auto directiveStart = skip_space(cursor, lineEnd);
+			if (directiveStart < lineEnd && *directiveStart == '#')
+			{
+				auto directive = read_ident(skip_space(directiveStart + 1, lineEnd), lineEnd);
+				auto args = directive.last;
+
+				if (equals(directive, "if") || equals(directive, "ifdef") || equals(directive, "ifndef"))
+				{
+					state s = (emitting) ? evaluator.evaluate(directive, args, lineEnd) : unknown;
+					block b = { s != unknown, s == state::defined, emitting, emitting && s != state::undefined };
+					blocks.push_back(b);
+					keep = emitting && !b.resolved;
+				}
+				else if (!blocks.empty() && (equals(directive, "elif") || equals(directive, "else") || equals(directive, "endif")))
+				{
+					auto& b = blocks.back();
+					keep = b.outerEmitting && !b.resolved;
+
+					if (equals(directive, "endif"))
+						blocks.pop_back();
+					else if (!b.resolved)
+						b.emitting = b.outerEmitting;
+					else if (b.taken)
+						b.emitting = false;
+					else if (equals(directive, "else"))
+						b.emitting = b.taken = b.outerEmitting;
+					else
+					{
+						state s = evaluator.evaluate(token("if", "if" + 2), args, lineEnd);
+						if (s == unknown && b.outerEmitting)
+						{
+							// remaining branches are left to the compiler, reopened as a plain conditional
+							result.append("#if");
+							result.append(args, nextLine);
+							b.resolved = false;
+							b.emitting = true;
+							cursor = nextLine;
+							continue;
+						}
+						b.taken = b.emitting = (s == state::defined) && b.outerEmitting;
+					}
+				}
+			}
+
+			if (keep)
+				result.append(cursor, nextLine);
+			else if (lineEnd < srcEnd)
+				result.push_back('\n');
+			cursor = nextLine;
+		}
+
+		return result;
+	}
+
+	include_cache::include_cache(file_watcher& watcher, bool int_file_id)
+		: watcher(&watcher)
+		, int_file_id(int_file_id)
+	{
+	}
+
+	include_cache& include_cache::shared(bool int_file_id)
+	{
+		static include_cache cache(file_watcher::shared(), false);
+		static include_cache intCache(file_watcher::shared(), true);
+		return (int_file_id) ? intCache : cache;
+	}
+
+	std::string const& include_cache::expand(char const* path)
+	{
+		auto& e = files[path];
+		if (e.expanding)
+			throwx( file_error(std::string("include cycle at ") + path) );
+
+		// reload modified files, identical content is not a change
+		bool changed = !e.valid;
+		if (!e.valid || watcher->generation(e.watch) != e.generation)
+		{
+			e.watch = watcher->watch(path);
+			e.generation = watcher->generation(e.watch);
+			auto source = load_file(path);
+			auto hash = hash64(source.data(), source.size());
+			if (hash != e.hash || source.size() != e.source.size())
+			{
+				e.source = MOVE(source);
+				e.hash = hash;
+				changed = true;
+			}
+		}
+
+		e.expanding = true;
+		try
+		{
+			for (size_t i = 0; i < e.includes.size() && !changed; ++i)
+			{
+				expand(e.includes[i].c_str());
+				changed = (version(e.includes[i].c_str()) != e.includeVersions[i]);
+			}
+
+			if (changed)
+			{
+				e.valid = false;
+				e.includes.clear();
+				e.includeVersions.clear();
+				detail::process_includes::cached_resolver resolver(*this, e);
+				auto expanded = process_includes_(e.source, path, resolver, stdx::data_range_param<char const>(), int_file_id);
+				if (expanded != e.expanded || !e.version)
+				{
+					e.expanded = MOVE(expanded);
+					++e.version;
+				}
+				e.valid = true;
+			}
+		}
+		catch (...)
+		{
+			e.expanding = false;
+			throw;
+		}
+		e.expanding = false;
+
+		return e.expanded;
+	}
+
+	std::string const& include_cache::expand(char const* path
+		, stdx::data_range_param<char const* const> defined, stdx::data_range_param<char const* const> undefined)
+	{
+		auto& expanded = expand(path);
+		auto& e = files[path];
+
+		std::string macros;
+		for (auto m : defined) macros.append("+").append(m);
+		for (auto m : undefined) macros.append("-").append(m);
+
+		auto& r = e.resolved[macros];
+		if (r.first != e.version)
+		{
+			r.second = resolve_conditionals(expanded, defined, undefined);
+			r.first = e.version;
+		}
+		return r.second;
+	}
+
+	unsigned long long include_cache::version(char const* path) const
+	{
+		auto it = files.find(path);
+		return (it != files.end()) ? it->second.version : 0;
+	}
+
+	std::vector<std::string> include_cache::dependencies(char const* path) const
+	{
+		std::vector<std::string> deps(1, path);
+		for (size_t i = 0; i < deps.size(); ++i)
+		{
+			auto it = files.find(deps[i]);
+			if (it == files.end())
+				continue;
+			for (auto& include : it->second.includes)
+				if (std::find(deps.begin(), deps.end(), include) == deps.end())
+					deps.push_back(include);
+		}
+		return deps;
 	}
 
 } // namespace
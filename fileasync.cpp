@@ -0,0 +1,495 @@
+#include "fileasync"
+#include "parallel"
+
+#include <atomic>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef WIN32
+	#define NOMINMAX
+	#include <Windows.h>
+#else
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <cerrno>
+#endif
+
+#ifdef STDX_IO_URING
+	#include <linux/io_uring.h>
+	#include <sys/syscall.h>
+	#include <sys/mman.h>
+	#include <sys/uio.h>
+#endif
+
+namespace stdx
+{
+	namespace detail
+	{
+		namespace async_read
+		{
+			unsigned const max_pool_threads = 8; // blocking reads, more threads mostly add seek contention
+
+			read_result read_blocking(read_request const& request)
+			{
+				read_result result = { 0, 0 };
+#ifdef WIN32
+				HANDLE file = ::CreateFileA(request.path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, NULL);
+				if (file == INVALID_HANDLE_VALUE)
+				{
+					result.error = ENOENT;
+					return result;
+				}
+				while (result.bytes < request.size)
+				{
+					unsigned long long offset = request.offset + result.bytes;
+					OVERLAPPED position = { 0 };
+					position.Offset = DWORD(offset);
+					position.OffsetHigh = DWORD(offset >> 32);
+					DWORD chunk = DWORD( min_value(request.size - result.bytes, size_t(1) << 30) ), bytesRead = 0;
+					if (!::ReadFile(file, request.dest + result.bytes, chunk, &bytesRead, &position))
+					{
+						if (::GetLastError() != ERROR_HANDLE_EOF)
+							result.error = EIO;
+						break;
+					}
+					if (bytesRead == 0)
+						break;
+					result.bytes += bytesRead;
+				}
+				::CloseHandle(file);
+#else
+				int fd = ::open(request.path.c_str(), O_RDONLY | O_CLOEXEC);
+				if (fd == -1)
+				{
+					result.error = errno;
+					return result;
+				}
+				while (result.bytes < request.size)
+				{
+					ssize_t bytesRead = ::pread(fd, request.dest + result.bytes, request.size - result.bytes, off_t(request.offset + result.bytes));
+					if (bytesRead == -1 && errno == EINTR)
+						continue;
+					if (bytesRead == -1)
+						result.error = errno;
+					if (bytesRead <= 0)
+						break;
+					result.bytes += size_t(bytesRead);
+				}
+				::close(fd);
+#endif
+				return result;
+			}
+
+			bool file_size(char const* path, size_t& size)
+			{
+#ifdef WIN32
+				struct _stat64 st;
+				if (::_stat64(path, &st) != 0)
+					return false;
+#else
+				struct stat st;
+				if (::stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+					return false;
+#endif
+				size = size_t(st.st_size);
+				return true;
+			}
+		}
+	}
+
+#ifdef STDX_IO_URING
+	// raw io_uring w/o liburing: shared submission & completion rings, readv requests
+	struct async_reader::ring
+	{
+		struct slot
+		{
+			item work;
+			int fd;
+			size_t bytes;
+			iovec vec;
+		};
+
+		int fd;
+		unsigned depth;
+
+		void* sqMap;
+		size_t sqMapSize;
+		void* cqMap;
+		size_t cqMapSize;
+		io_uring_sqe* sqes;
+		size_t sqesSize;
+
+		unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+		unsigned *cqHead, *cqTail, *cqMask;
+		io_uring_cqe* cqes;
+
+		std::vector<slot> slots;
+		std::vector<unsigned> freeSlots;
+		unsigned toSubmit;
+
+		ring() : fd(-1), sqMap(MAP_FAILED), cqMap(MAP_FAILED), sqes((io_uring_sqe*) MAP_FAILED), toSubmit(0) { }
+		~ring()
+		{
+			if (sqes != MAP_FAILED) ::munmap(sqes, sqesSize);
+			if (cqMap != MAP_FAILED && cqMap != sqMap) ::munmap(cqMap, cqMapSize);
+			if (sqMap != MAP_FAILED) ::munmap(sqMap, sqMapSize);
+			if (fd != -1) ::close(fd);
+		}
+
+		// returns false if io_uring is not available
+		bool setup(unsigned entries)
+		{
+			io_uring_params params;
+			memset(&params, 0, sizeof(params));
+			fd = (int) ::syscall(__NR_io_uring_setup, entries, &params);
+			if (fd < 0)
+				return false;
+			depth = params.sq_entries;
+
+			sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+			if (singleMap)
+				sqMapSize = cqMapSize = max_value(sqMapSize, cqMapSize);
+
+			sqMap = ::mmap(nullptr, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+			if (sqMap == MAP_FAILED)
+				return false;
+			cqMap = (singleMap) ? sqMap
+				: ::mmap(nullptr, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			if (cqMap == MAP_FAILED)
+				return false;
+			sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+			sqes = (io_uring_sqe*) ::mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+			if (sqes == MAP_FAILED)
+				return false;
+
+			auto sq = static_cast<char*>(sqMap), cq = static_cast<char*>(cqMap);
+			sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+			sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+			sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+			sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+			cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+			cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+			cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+			cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+			slots.resize(depth);
+			for (unsigned i = depth; i-- > 0; )
+				freeSlots.push_back(i);
+			return true;
+		}
+
+		unsigned inFlight() const { return depth - unsigned(freeSlots.size()); }
+
+		// queues a read of the remaining bytes of the given slot
+		void push(unsigned slotIdx)
+		{
+			auto& s = slots[slotIdx];
+			s.vec.iov_base = s.work.request.dest + s.bytes;
+			s.vec.iov_len = s.work.request.size - s.bytes;
+
+			unsigned tail = *sqTail;
+			unsigned idx = tail & *sqMask;
+			auto& sqe = sqes[idx];
+			memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = IORING_OP_READV;
+			sqe.fd = s.fd;
+			sqe.off = s.work.request.offset + s.bytes;
+			sqe.addr = (unsigned long long) &s.vec;
+			sqe.len = 1;
+			sqe.user_data = slotIdx;
+			sqArray[idx] = idx;
+			__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+			++toSubmit;
+		}
+
+		// submits queued reads, optionally blocking for at least one completion; false if the ring failed
+		bool enter(bool wait)
+		{
+			unsigned flags = (wait) ? IORING_ENTER_GETEVENTS : 0;
+			while (true)
+			{
+				int submitted = (int) ::syscall(__NR_io_uring_enter, fd, toSubmit, (wait) ? 1 : 0, flags, nullptr, 0);
+				if (submitted >= 0)
+				{
+					toSubmit -= unsigned(submitted);
+					if (!toSubmit || wait)
+						return true;
+				}
+				else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+					return false;
+			}
+		}
+	};
+#else
+	struct async_reader::ring { };
+#endif
+
+	async_reader::async_reader(unsigned threads, bool useRing, unsigned queueDepth)
+		: pending(0)
+		, quit(false)
+	{
+#ifdef STDX_IO_URING
+		if (useRing)
+		{
+			uring.reset(new ring());
+			if (uring->setup(max_value(queueDepth, 1U)))
+				workers.push_back( std::thread([this]() { driveRing(); }) );
+			else
+				uring.reset();
+		}
+#endif
+		if (!uring)
+		{
+			if (!threads)
+				threads = min_value(hardware_threads(), detail::async_read::max_pool_threads);
+			for (unsigned i = 0; i < threads; ++i)
+				workers.push_back( std::thread([this]() { work(); }) );
+		}
+	}
+
+	async_reader::~async_reader()
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			idle.wait(lock, [this]() { return pending == 0; });
+			quit = true;
+		}
+		wakeup.notify_all();
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	void async_reader::read(std::vector<read_request> batch, read_callback callback)
+	{
+		if (batch.empty())
+			return;
+
+		auto sharedCallback = std::make_shared<read_callback>(MOVE(callback));
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t i = 0; i < batch.size(); ++i)
+			{
+				item work = { MOVE(batch[i]), i, sharedCallback };
+				queue.push_back(MOVE(work));
+			}
+			pending += batch.size();
+		}
+		wakeup.notify_all();
+	}
+
+	std::future<void> async_reader::read(std::vector<read_request> batch)
+	{
+		struct state
+		{
+			std::promise<void> done;
+			std::atomic<size_t> remaining;
+			std::mutex mutex;
+			std::string failedPath;
+		};
+		auto batchState = std::make_shared<state>();
+		batchState->remaining = batch.size();
+		auto future = batchState->done.get_future();
+		if (batch.empty())
+		{
+			batchState->done.set_value();
+			return future;
+		}
+
+		read(MOVE(batch), [batchState](size_t, read_request const& request, read_result const& result)
+		{
+			if (result.error)
+			{
+				std::lock_guard<std::mutex> lock(batchState->mutex);
+				if (batchState->failedPath.empty())
+					batchState->failedPath = request.path;
+			}
+			if (--batchState->remaining == 0)
+			{
+				if (batchState->failedPath.empty())
+					batchState->done.set_value();
+				else
+					batchState->done.set_exception( std::make_exception_ptr(file_error(batchState->failedPath)) );
+			}
+		});
+		return future;
+	}
+
+	void async_reader::wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		idle.wait(lock, [this]() { return pending == 0; });
+	}
+
+	void async_reader::complete(item const& work, read_result const& result)
+	{
+		(*work.callback)(work.index, work.request, result);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--pending == 0)
+			idle.notify_all();
+	}
+
+	void async_reader::work()
+	{
+		while (true)
+		{
+			item work;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeup.wait(lock, [this]() { return quit || !queue.empty(); });
+				if (queue.empty())
+					return;
+				work = MOVE(queue.front());
+				queue.pop_front();
+			}
+			complete(work, detail::async_read::read_blocking(work.request));
+		}
+	}
+
+	void async_reader::driveRing()
+	{
+#ifdef STDX_IO_URING
+		auto& r = *uring;
+		while (true)
+		{
+			// fill free slots from the queue, only sleep when nothing is in flight
+			std::vector<item> incoming;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (!r.inFlight())
+					wakeup.wait(lock, [this]() { return quit || !queue.empty(); });
+				if (quit && queue.empty() && !r.inFlight())
+					return;
+				while (!queue.empty() && incoming.size() < r.freeSlots.size())
+				{
+					incoming.push_back(MOVE(queue.front()));
+					queue.pop_front();
+				}
+			}
+
+			for (auto& work : incoming)
+			{
+				int fd = ::open(work.request.path.c_str(), O_RDONLY | O_CLOEXEC);
+				if (fd == -1 || work.request.size == 0)
+				{
+					read_result result = { 0, (fd == -1) ? errno : 0 };
+					if (fd != -1)
+						::close(fd);
+					complete(work, result);
+					continue;
+				}
+				unsigned slotIdx = r.freeSlots.back();
+				r.freeSlots.pop_back();
+				auto& s = r.slots[slotIdx];
+				s.work = MOVE(work);
+				s.fd = fd;
+				s.bytes = 0;
+				r.push(slotIdx);
+			}
+
+			if (!r.inFlight())
+				continue;
+			if (!r.enter(true))
+			{
+				// ring unusable, redo the reads in flight & all further reads w/ blocking reads
+				for (unsigned slotIdx = 0; slotIdx < r.depth; ++slotIdx)
+					if (std::find(r.freeSlots.begin(), r.freeSlots.end(), slotIdx) == r.freeSlots.end())
+					{
+						auto& s = r.slots[slotIdx];
+						::close(s.fd);
+						item work = MOVE(s.work);
+						complete(work, detail::async_read::read_blocking(work.request));
+					}
+				r.freeSlots.clear();
+				work();
+				return;
+			}
+
+			unsigned head = *r.cqHead;
+			unsigned tail = __atomic_load_n(r.cqTail, __ATOMIC_ACQUIRE);
+			for (; head != tail; ++head)
+			{
+				auto& cqe = r.cqes[head & *r.cqMask];
+				unsigned slotIdx = unsigned(cqe.user_data);
+				auto& s = r.slots[slotIdx];
+
+				bool retry = (cqe.res == -EINTR || cqe.res == -EAGAIN);
+				if (cqe.res > 0)
+				{
+					s.bytes += size_t(cqe.res);
+					// short read before end of file, queue the remainder
+					retry = (s.bytes < s.work.request.size);
+				}
+				if (retry)
+				{
+					r.push(slotIdx);
+					continue;
+				}
+
+				read_result result = { s.bytes, (cqe.res < 0) ? -cqe.res : 0 };
+				::close(s.fd);
+				item work = MOVE(s.work);
+				r.freeSlots.push_back(slotIdx);
+				complete(work, result);
+			}
+			__atomic_store_n(r.cqHead, head, __ATOMIC_RELEASE);
+		}
+#endif
+	}
+
+	std::future< std::vector< std::vector<char> > > load_binary_files(async_reader& reader
+		, std::vector<std::string> paths, bool nullterminated)
+	{
+		// destination buffers are owned by the batch callback, they outlive the last read even if the future is dropped
+		struct state
+		{
+			std::promise< std::vector< std::vector<char> > > done;
+			std::atomic<size_t> remaining;
+			std::mutex mutex;
+			std::string failedPath;
+			std::vector< std::vector<char> > files;
+		};
+		auto batchState = std::make_shared<state>();
+		batchState->files.resize(paths.size());
+		batchState->remaining = paths.size();
+		auto future = batchState->done.get_future();
+
+		std::vector<read_request> batch(paths.size());
+		for (size_t i = 0; i < paths.size(); ++i)
+		{
+			size_t size = 0;
+			if (!detail::async_read::file_size(paths[i].c_str(), size))
+				throwx( file_error(paths[i]) );
+			batchState->files[i].resize(size + (size_t) nullterminated);
+
+			read_request request = { MOVE(paths[i]), 0, size, batchState->files[i].data() };
+			batch[i] = MOVE(request);
+		}
+		if (batch.empty())
+		{
+			batchState->done.set_value( std::vector< std::vector<char> >() );
+			return future;
+		}
+
+		reader.read(MOVE(batch), [batchState](size_t, read_request const& request, read_result const& result)
+		{
+			if (result.error)
+			{
+				std::lock_guard<std::mutex> lock(batchState->mutex);
+				if (batchState->failedPath.empty())
+					batchState->failedPath = request.path;
+			}
+			if (--batchState->remaining == 0)
+			{
+				if (batchState->failedPath.empty())
+					batchState->done.set_value( MOVE(batchState->files) );
+				else
+					batchState->done.set_exception( std::make_exception_ptr(file_error(batchState->failedPath)) );
+			}
+		});
+		return future;
+	}
+
+} // namespace
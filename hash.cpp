@@ -0,0 +1,268 @@
+#include "hash"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define STDX_HASH_SSE2
+	#include <emmintrin.h>
+#endif
+#if defined(STDX_HASH_SSE2) && (defined(_MSC_VER) || defined(__GNUC__))
+	#define STDX_HASH_AVX2
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define STDX_HASH_TARGET_AVX2
+	#else
+		#define STDX_HASH_TARGET_AVX2 __attribute__((target("avx2")))
+	#endif
+#endif
+
+namespace stdx
+{
+	namespace
+	{
+		typedef unsigned long long u64;
+
+		u64 const prime32_1 = 0x9E3779B1ULL;
+		u64 const prime64_1 = 0x9E3779B185EBCA87ULL;
+		u64 const prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+		u64 const prime64_3 = 0x165667B19E3779F9ULL;
+		u64 const prime64_4 = 0x85EBCA77C2B2AE63ULL;
+		u64 const prime64_5 = 0x27D4EB2F165667C5ULL;
+
+		size_t const hash_lanes = 8;
+		size_t const stripe_size = 8 * hash_lanes;
+		size_t const block_stripes = 16;
+
+		inline u64 read64(char const* p)
+		{
+			u64 v;
+			memcpy(&v, p, sizeof(v));
+			return v;
+		}
+
+		inline u64 rotl64(u64 x, unsigned r) { return (x << r) | (x >> (64 - r)); }
+
+		void accumulate(u64* acc, char const* p, size_t stripes, u64 const* key)
+		{
+			for (size_t s = 0; s < stripes; ++s, p += stripe_size)
+				for (size_t i = 0; i < hash_lanes; ++i)
+				{
+					u64 v = read64(p + 8 * i);
+					u64 k = v ^ key[i];
+					acc[i ^ 1] += v;
+					acc[i] += (k & 0xffffffffULL) * (k >> 32);
+				}
+		}
+
+		void scramble(u64* acc, u64 const* key)
+		{
+			for (size_t i = 0; i < hash_lanes; ++i)
+			{
+				u64 a = acc[i];
+				a ^= a >> 47;
+				a ^= key[i];
+				acc[i] = a * prime32_1;
+			}
+		}
+
+		// all full stripes, scrambling after every block
+		void hash_stripes_scalar(u64* acc, char const* p, size_t stripes, u64 const* key)
+		{
+			for (size_t blockEnd = block_stripes; blockEnd <= stripes; blockEnd += block_stripes)
+			{
+				accumulate(acc, p, block_stripes, key);
+				scramble(acc, key);
+				p += block_stripes * stripe_size;
+			}
+			accumulate(acc, p, stripes % block_stripes, key);
+		}
+
+#ifdef STDX_HASH_SSE2
+		// lanes i and i ^ 1 share a register, which turns the cross-lane add into a 64-bit swap
+		inline void accumulate_sse2(__m128i* acc, char const* p, size_t stripes, __m128i const* key)
+		{
+			for (size_t s = 0; s < stripes; ++s, p += stripe_size)
+				for (size_t j = 0; j < hash_lanes / 2; ++j)
+				{
+					__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p) + j);
+					__m128i k = _mm_xor_si128(v, key[j]);
+					__m128i product = _mm_mul_epu32(k, _mm_srli_epi64(k, 32));
+					__m128i swapped = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+					acc[j] = _mm_add_epi64(acc[j], _mm_add_epi64(product, swapped));
+				}
+		}
+
+		inline void scramble_sse2(__m128i* acc, __m128i const* key)
+		{
+			__m128i const prime = _mm_set1_epi32(int(prime32_1));
+			for (size_t j = 0; j < hash_lanes / 2; ++j)
+			{
+				__m128i a = acc[j];
+				a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+				a = _mm_xor_si128(a, key[j]);
+				__m128i lo = _mm_mul_epu32(a, prime);
+				__m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+				acc[j] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+			}
+		}
+
+		void hash_stripes_sse2(u64* acc, char const* p, size_t stripes, u64 const* key)
+		{
+			__m128i vacc[hash_lanes / 2], vkey[hash_lanes / 2];
+			for (size_t j = 0; j < hash_lanes / 2; ++j)
+			{
+				vacc[j] = _mm_loadu_si128(reinterpret_cast<__m128i const*>(acc) + j);
+				vkey[j] = _mm_loadu_si128(reinterpret_cast<__m128i const*>(key) + j);
+			}
+
+			for (size_t blockEnd = block_stripes; blockEnd <= stripes; blockEnd += block_stripes)
+			{
+				accumulate_sse2(vacc, p, block_stripes, vkey);
+				scramble_sse2(vacc, vkey);
+				p += block_stripes * stripe_size;
+			}
+			accumulate_sse2(vacc, p, stripes % block_stripes, vkey);
+
+			for (size_t j = 0; j < hash_lanes / 2; ++j)
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(acc) + j, vacc[j]);
+		}
+#endif
+
+#ifdef STDX_HASH_AVX2
+		STDX_HASH_TARGET_AVX2 inline void accumulate_avx2(__m256i* acc, char const* p, size_t stripes, __m256i const* key)
+		{
+			for (size_t s = 0; s < stripes; ++s, p += stripe_size)
+				for (size_t j = 0; j < hash_lanes / 4; ++j)
+				{
+					__m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p) + j);
+					__m256i k = _mm256_xor_si256(v, key[j]);
+					__m256i product = _mm256_mul_epu32(k, _mm256_srli_epi64(k, 32));
+					__m256i swapped = _mm256_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+					acc[j] = _mm256_add_epi64(acc[j], _mm256_add_epi64(product, swapped));
+				}
+		}
+
+		STDX_HASH_TARGET_AVX2 inline void scramble_avx2(__m256i* acc, __m256i const* key)
+		{
+			__m256i const prime = _mm256_set1_epi32(int(prime32_1));
+			for (size_t j = 0; j < hash_lanes / 4; ++j)
+			{
+				__m256i a = acc[j];
+				a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+				a = _mm256_xor_si256(a, key[j]);
+				__m256i lo = _mm256_mul_epu32(a, prime);
+				__m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime);
+				acc[j] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+			}
+		}
+
+		STDX_HASH_TARGET_AVX2 void hash_stripes_avx2(u64* acc, char const* p, size_t stripes, u64 const* key)
+		{
+			__m256i vacc[hash_lanes / 4], vkey[hash_lanes / 4];
+			for (size_t j = 0; j < hash_lanes / 4; ++j)
+			{
+				vacc[j] = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(acc) + j);
+				vkey[j] = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(key) + j);
+			}
+
+			for (size_t blockEnd = block_stripes; blockEnd <= stripes; blockEnd += block_stripes)
+			{
+				accumulate_avx2(vacc, p, block_stripes, vkey);
+				scramble_avx2(vacc, vkey);
+				p += block_stripes * stripe_size;
+			}
+			accumulate_avx2(vacc, p, stripes % block_stripes, vkey);
+
+			for (size_t j = 0; j < hash_lanes / 4; ++j)
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(acc) + j, vacc[j]);
+		}
+
+		bool cpu_supports_avx2()
+		{
+	#ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 0);
+			if (info[0] < 7)
+				return false;
+			__cpuid(info, 1);
+			bool osxsave = (info[2] & (1 << 27)) != 0;
+			bool avx = (info[2] & (1 << 28)) != 0;
+			if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+				return false;
+			__cpuidex(info, 7, 0);
+			return (info[1] & (1 << 5)) != 0;
+	#else
+			return __builtin_cpu_supports("avx2") != 0;
+	#endif
+		}
+#endif
+
+	} // namespace
+
+	hash_isa::t hash_isa_supported()
+	{
+		static hash_isa::t const isa = []() -> hash_isa::t {
+#if defined(STDX_HASH_AVX2)
+			if (cpu_supports_avx2())
+				return hash_isa::avx2;
+#endif
+#if defined(STDX_HASH_SSE2)
+			return hash_isa::sse2;
+#else
+			return hash_isa::scalar;
+#endif
+		}();
+		return isa;
+	}
+
+	unsigned long long hash64(void const* data, size_t size, unsigned long long seed, hash_isa::t isa)
+	{
+		u64 key[hash_lanes];
+		u64 acc[hash_lanes];
+		for (size_t i = 0; i < hash_lanes; ++i)
+		{
+			key[i] = rotl64(prime64_1 * (i + 1), unsigned(7 * i + 11)) + seed;
+			acc[i] = (i & 1) ? prime64_2 : prime32_1;
+		}
+
+		auto supported = hash_isa_supported();
+		if (isa == hash_isa::best || isa > supported)
+			isa = supported;
+
+		auto p = static_cast<char const*>(data);
+		size_t stripes = size / stripe_size;
+		switch (isa)
+		{
+#ifdef STDX_HASH_AVX2
+		case hash_isa::avx2: hash_stripes_avx2(acc, p, stripes, key); break;
+#endif
+#ifdef STDX_HASH_SSE2
+		case hash_isa::sse2: hash_stripes_sse2(acc, p, stripes, key); break;
+#endif
+		default: hash_stripes_scalar(acc, p, stripes, key); break;
+		}
+		p += stripes * stripe_size;
+
+		// zero-padded tail, disambiguated by the length mixed in below
+		size_t tail = size % stripe_size;
+		if (tail)
+		{
+			char last[stripe_size] = { 0 };
+			memcpy(last, p, tail);
+			accumulate(acc, last, 1, key);
+		}
+
+		u64 h = u64(size) * prime64_1 + seed;
+		for (size_t i = 0; i < hash_lanes; ++i)
+		{
+			h ^= rotl64(acc[i] * prime64_2, 31) * prime64_1;
+			h = rotl64(h, 27) * prime64_1 + prime64_4;
+		}
+		h ^= h >> 33;
+		h *= prime64_2;
+		h ^= h >> 29;
+		h *= prime64_3;
+		h ^= h >> 32;
+		return h ^ prime64_5;
+	}
+
+} // namespace
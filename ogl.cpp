@@ -1,6 +1,9 @@
 #include "ogl"
+#include "hash"
 
 #include <map>
+#include <fstream>
+#include <cstdio>
 
 namespace ogl
 {
@@ -68,6 +71,339 @@ namespace ogl
 			std::cout << srcS << ": " << typeS << "(" << severityS << ") " << id << ": " << message << std::endl;
 	}
 
+	namespace detail
+	{
+		namespace program_cache
+		{
+			char const magic[4] = { 'l', 'g', 'p', 'b' };
+			unsigned const version = 1; // bump to invalidate all stored binaries
+
+			struct header
+			{
+				char magic[4];
+				unsigned version;
+				unsigned long long key;
+				GLenum format;
+				unsigned size;
+			};
+
+			unsigned long long hash_string(char const* str, unsigned long long seed)
+			{
+				return (str) ? stdx::hash64(str, strlen(str), seed) : seed;
+			}
+		}
+	}
+
+	unsigned long long ProgramCache::key(stdx::data_range_param<char const> source, char const* preamble, unsigned options)
+	{
+		using namespace detail::program_cache;
+
+		if (enabled && !driverHash)
+		{
+			GLint formatCount = 0;
+			glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+			if (glGetError() != GL_NO_ERROR || formatCount <= 0)
+				enabled = false;
+
+			driverHash = hash_string((char const*) glGetString(GL_VENDOR), version);
+			driverHash = hash_string((char const*) glGetString(GL_RENDERER), driverHash);
+			driverHash = hash_string((char const*) glGetString(GL_VERSION), driverHash);
+			driverHash = hash_string((char const*) glGetString(GL_SHADING_LANGUAGE_VERSION), driverHash);
+			if (!driverHash) driverHash = 1;
+		}
+		
+		auto h = stdx::hash64(source.data(), source.size(), driverHash);
+		h = hash_string(preamble, h);
+		return stdx::hash64(&options, sizeof(options), h);
+	}
+
+	std::string ProgramCache::path(unsigned long long key) const
+	{
+		char name[32];
+		sprintf(name, "/%016llx.glbin", key);
+		return directory + name;
+	}
+
+	Program ProgramCache::load(unsigned long long key) const
+	{
+		using namespace detail::program_cache;
+
+		auto file = path(key);
+		if (!enabled || stdx::file_time(file.c_str()) <= 0)
+			return nullptr;
+
+		std::ifstream stream(file, std::ios_base::binary);
+		header head;
+		if (!stream.read(reinterpret_cast<char*>(&head), sizeof(head))
+			|| memcmp(head.magic, magic, sizeof(magic)) != 0 || head.version != version || head.key != key)
+			return nullptr;
+
+		std::vector<char> binary(head.size);
+		if (!stream.read(binary.data(), binary.size()))
+			return nullptr;
+
+		auto program = Program::create();
+		glProgramBinary(program, head.format, binary.data(), (GLsizei) binary.size());
+		
+		// rejected after driver updates etc., not an error
+		GLint status = GL_FALSE;
+		if (glGetError() == GL_NO_ERROR)
+			glGetProgramiv(program, GL_LINK_STATUS, &status);
+		while (glGetError() != GL_NO_ERROR);
+
+		if (status != GL_TRUE)
+			return nullptr;
+		return program;
+	}
+
+	void ProgramCache::store(unsigned long long key, GLuint program) const
+	{
+		using namespace detail::program_cache;
+
+		if (!enabled || !stdx::make_directory(directory.c_str()))
+			return;
+
+		GLenum format;
+		auto binary = ProgramRef(program).getBinary(&format);
+		if (binary.empty())
+			return;
+
+		header head;
+		memcpy(head.magic, magic, sizeof(magic));
+		head.version = version;
+		head.key = key;
+		head.format = format;
+		head.size = (unsigned) binary.size();
+
+		auto file = path(key);
+		std::ofstream stream(file, std::ios_base::binary | std::ios_base::trunc);
+		stream.write(reinterpret_cast<char const*>(&head), sizeof(head));
+		stream.write(binary.data(), binary.size());
+		// never leave partial binaries behind
+		stream.close();
+		if (stream.fail())
+			remove(file.c_str());
+	}
+
+	ProgramCache& ProgramCache::shared()
+	{
+		static ProgramCache cache(stdx::exe_directory() + "/shadercache");
+		return cache;
+	}
+
+	namespace detail
+	{
+		namespace program_variants
+		{
+			// one variant per line, preambles span lines
+			std::string escape(std::string const& str)
+			{
+				std::string result;
+				result.reserve(str.size());
+				for (char c : str)
+					switch (c)
+					{
+					case '\\': result += "\\\\"; break;
+					case '\n': result += "\\n"; break;
+					case '\r': result += "\\r"; break;
+					case '\t': result += "\\t"; break;
+					default: result += c;
+					}
+				return result;
+			}
+
+			std::string unescape(char const* str, char const* end)
+			{
+				std::string result;
+				result.reserve(end - str);
+				for (; str < end; ++str)
+				{
+					char c = *str;
+					if (c == '\\' && str + 1 < end)
+						switch (c = *++str)
+						{
+						case 'n': c = '\n'; break;
+						case 'r': c = '\r'; break;
+						case 't': c = '\t'; break;
+						}
+					result += c;
+				}
+				return result;
+			}
+		}
+	}
+
+	ProgramVariants::ProgramVariants(std::string listFile, bool compatibilityInclude)
+		: listFile(std::move(listFile))
+		, listChanged(false)
+		, compatibilityInclude(compatibilityInclude)
+		, changes(stdx::include_cache::shared(compatibilityInclude).watcher->changes)
+	{
+		if (!this->listFile.empty())
+			load(this->listFile.c_str());
+	}
+
+	ProgramVariants::~ProgramVariants()
+	{
+		if (!listFile.empty() && listChanged)
+			save(listFile.c_str());
+	}
+
+	std::string ProgramVariants::key(char const* file, char const* preamble, unsigned options)
+	{
+		char optionStr[16];
+		sprintf(optionStr, "%x", options & ~ProgramWithTime::Async);
+		std::string result(optionStr);
+		result.append(1, '\0').append(file).append(1, '\0').append(preamble);
+		return result;
+	}
+
+	ProgramVariants::variant& ProgramVariants::request(char const* file, char const* preamble, unsigned options)
+	{
+		auto& v = variants[key(file, preamble, options)];
+		if (v.file.empty())
+		{
+			v.file = file;
+			v.preamble = preamble;
+			v.options = options & ~ProgramWithTime::Async;
+			v.queued = true;
+			v.failed = false;
+			queue.push_back(&v);
+			listChanged = true;
+		}
+		return v;
+	}
+
+	GLuint ProgramVariants::get(char const* file, char const* preamble, unsigned options, GLuint fallback)
+	{
+		auto& v = request(file, preamble, options);
+		if (v.program && *v.program)
+			return *v.program;
+
+		// never request the plain variant implicitly, some shaders only compile w/ their defines
+		if (!fallback && *preamble)
+		{
+			auto it = variants.find(key(file, "", options));
+			if (it != variants.end() && it->second.program && *it->second.program)
+				fallback = *it->second.program;
+		}
+		return fallback;
+	}
+
+	bool ProgramVariants::start(variant& v)
+	{
+		v.queued = false;
+		try
+		{
+			v.program.reset( new ProgramWithTime(v.file, v.preamble.c_str(), v.options | ProgramWithTime::Async, compatibilityInclude) );
+			return *v.program != 0; // served from the program cache
+		}
+		catch (ogl_error const& e)
+		{
+			std::cerr << "Failed to build program variant of " << v.file << ": " << e.what() << std::endl;
+		}
+		catch (stdx::file_error const& e)
+		{
+			std::cerr << "Failed to load program variant of " << v.file << ": " << e.what() << std::endl;
+		}
+		v.failed = true;
+		return false;
+	}
+
+	unsigned ProgramVariants::update(unsigned maxStarts)
+	{
+		unsigned swapped = 0;
+		for (auto& it : variants)
+		{
+			auto& v = it.second;
+			if (!v.program)
+				continue;
+			int reloaded = v.program->maybeReload();
+			if (reloaded > 0) ++swapped;
+			if (reloaded) v.failed = reloaded < 0;
+		}
+
+		// variants that failed to construct have no program to hot-reload, retry those once sources change
+		auto& includes = stdx::include_cache::shared(compatibilityInclude);
+		includes.watcher->poll();
+		if (includes.watcher->changes != changes)
+		{
+			changes = includes.watcher->changes;
+			for (auto& it : variants)
+			{
+				auto& v = it.second;
+				if (!v.program && v.failed && !v.queued)
+				{
+					v.queued = true;
+					queue.push_back(&v);
+				}
+			}
+		}
+
+		for (unsigned i = 0; i < maxStarts && !queue.empty(); ++i)
+		{
+			swapped += start(*queue.front());
+			queue.pop_front();
+		}
+		return swapped;
+	}
+
+	void ProgramVariants::finishAll()
+	{
+		while (!queue.empty())
+		{
+			start(*queue.front());
+			queue.pop_front();
+		}
+
+		for (auto& it : variants)
+		{
+			auto& v = it.second;
+			if (v.program && v.program->pending)
+			{
+				try { v.program->finishLoad(); }
+				catch (ogl_error const &) { v.failed = true; }
+			}
+		}
+	}
+
+	void ProgramVariants::load(char const* listFile)
+	{
+		using namespace detail::program_variants;
+
+		std::ifstream stream(listFile);
+		std::string line;
+		while (std::getline(stream, line))
+		{
+			// options \t file \t preamble
+			auto fileStart = line.find('\t');
+			auto preambleStart = (fileStart != line.npos) ? line.find('\t', fileStart + 1) : line.npos;
+			if (preambleStart == line.npos)
+				continue;
+
+			auto options = (unsigned) strtoul(line.c_str(), nullptr, 16);
+			auto file = unescape(line.data() + fileStart + 1, line.data() + preambleStart);
+			auto preamble = unescape(line.data() + preambleStart + 1, line.data() + line.size());
+			request(file.c_str(), preamble.c_str(), options);
+		}
+		// nothing new yet
+		listChanged = false;
+	}
+
+	void ProgramVariants::save(char const* listFile) const
+	{
+		using namespace detail::program_variants;
+
+		std::ofstream stream(listFile, std::ios_base::trunc);
+		for (auto& it : variants)
+		{
+			auto& v = it.second;
+			char optionStr[16];
+			sprintf(optionStr, "%x\t", v.options);
+			stream << optionStr << escape(v.file) << '\t' << escape(v.preamble) << '\n';
+		}
+	}
+
 	void GLFWWindow::resizeCallback(GLFWwindow *window, int w, int h)
 	{
 		auto* self = getThis<GLFWWindow>(window);
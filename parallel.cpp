@@ -0,0 +1,132 @@
+#include "parallel"
+
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <deque>
+
+#ifndef WIN32
+	#include <unistd.h>
+#endif
+
+namespace stdx
+{
+	unsigned hardware_threads()
+	{
+		static unsigned const threads = [] {
+			unsigned n = std::thread::hardware_concurrency();
+			return (n) ? n : 1;
+		}();
+		return threads;
+	}
+
+	namespace
+	{
+		struct parallel_job
+		{
+			void (*work)(void*);
+			void* context;
+			unsigned running;            // helpers that started, guarded by the pool mutex
+			std::exception_ptr error;    // first one
+		};
+
+		// hardware_threads() - 1 workers, the calling thread always takes part
+		struct parallel_pool
+		{
+			std::mutex mutex;
+			std::condition_variable wakeup; // workers: helper requests
+			std::condition_variable done;   // callers: helpers finished
+			std::deque<parallel_job*> queue;
+			long owner;                     // process, threads do not survive fork()
+
+			parallel_pool()
+				: owner(current_process())
+			{
+				for (unsigned i = 1, ie = hardware_threads(); i < ie; ++i)
+					std::thread(&parallel_pool::work, this).detach();
+			}
+
+			static long current_process()
+			{
+#ifdef WIN32
+				return 0;
+#else
+				return long(::getpid());
+#endif
+			}
+
+			void work()
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (true)
+				{
+					wakeup.wait(lock, [this]() { return !queue.empty(); });
+					auto job = queue.front();
+					queue.pop_front();
+					++job->running;
+					lock.unlock();
+
+					std::exception_ptr error;
+					try { job->work(job->context); }
+					catch (...) { error = std::current_exception(); }
+
+					lock.lock();
+					if (error && !job->error)
+						job->error = error;
+					--job->running;
+					done.notify_all();
+				}
+			}
+
+			void run(parallel_job& job, unsigned helpers)
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					for (unsigned i = 0; i < helpers; ++i)
+						queue.push_back(&job);
+				}
+				if (helpers == 1)
+					wakeup.notify_one();
+				else
+					wakeup.notify_all();
+
+				std::exception_ptr error;
+				try { job.work(job.context); }
+				catch (...) { error = std::current_exception(); }
+
+				// all chunks are taken, withdraw helpers that have not started & wait for the others
+				std::unique_lock<std::mutex> lock(mutex);
+				for (auto it = queue.begin(); it != queue.end(); )
+					it = (*it == &job) ? queue.erase(it) : it + 1;
+				done.wait(lock, [&job]() { return job.running == 0; });
+
+				if (!error)
+					error = job.error;
+				if (error)
+					std::rethrow_exception(error);
+			}
+
+			// pools are leaked, worker threads are never joined
+			static parallel_pool& shared()
+			{
+				static std::mutex creation;
+				static parallel_pool* pool = nullptr;
+				std::lock_guard<std::mutex> lock(creation);
+				if (!pool || pool->owner != current_process())
+					pool = new parallel_pool();
+				return *pool;
+			}
+		};
+
+	} // namespace
+
+	namespace detail
+	{
+		void parallel_run(void (*work)(void* context), void* context, unsigned helpers)
+		{
+			parallel_job job = { work, context, 0, std::exception_ptr() };
+			parallel_pool::shared().run(job, helpers);
+		}
+	}
+
+} // namespace
@@ -1,6 +1,6 @@
 #include "scenex"
 
-#include "file"
+#include "filex"
 #include <algorithm>
 
 namespace scene
@@ -79,12 +79,34 @@ int scenecvt::run(stdx::data_range_param<char const *const> inputs, char const*
 	cmd.append(output);
 	cmd.append("\"");
 
-	return system(cmd.c_str());
+	int result = system(cmd.c_str());
+	if (result == 0)
+		postprocess(output);
+	return result;
+}
+
+void scenecvt::postprocess(char const* sceneFile) const
+{
+	if (!interleaveVertices)
+		return;
+
+	Scene scene;
+	{
+		auto data = stdx::load_binary_file(sceneFile);
+		scene = load_scene(data, io_error_handlers::exception);
+	}
+	interleave_vertices(scene);
+
+	auto bin = dump_scene(scene);
+	auto file = stdx::write_binary_file(sceneFile);
+	file.write(bin.data(), bin.size());
 }
 
-std::string scenecvt::locateOrRun(char const* srcFile, bool skipIfUpToDate) const
+std::string scenecvt::locateOrRun(char const* srcFile, bool skipIfUpToDate, bool* converted) const
 {
 	std::string result = srcFile;
+	if (converted)
+		*converted = false;
 
 	auto srcExtBegin = strrchr(srcFile, '.');
 	char const sceneExt[] = ".scene";
@@ -100,8 +122,12 @@ std::string scenecvt::locateOrRun(char const* srcFile, bool skipIfUpToDate) cons
 
 		// Try to convert
 		if (!located)
+		{
+			if (converted)
+				*converted = true;
 			if (run(stdx::make_range_n(&srcFile, 1), outFile.c_str()) != 0)
 				throwx( stdx::file_error("unable to convert file") );
+		}
 
 		result = outFile;
 	}
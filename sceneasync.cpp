@@ -0,0 +1,245 @@
+#include "sceneasync"
+
+#include "filex"
+
+#include <algorithm>
+
+namespace scene
+{
+
+namespace
+{
+	typedef void error_handler(char const* id, char const* what);
+
+	size_t const read_block_size = 8 << 20;
+
+	// materials & textures may still be rewritten by complete_texture_pool()
+	bool is_deferred_chunk(char const* id)
+	{
+		return strcmp(id, "mat") == 0 || strcmp(id, "texp") == 0;
+	}
+
+	// reads the file block by block, only as far as requested
+	struct BlockReader
+	{
+		std::ifstream file;
+		std::vector<char> data;
+		size_t loaded;
+		AsyncSceneLoad& load;
+
+		bool checksummed;
+		std::vector<ChunkHash> hashes;
+		std::vector<size_t> chunkOffsets; // covered by hashes, in the same order
+
+		BlockReader(char const* path, AsyncSceneLoad& load)
+			: file(stdx::read_binary_file(path))
+			, loaded(0)
+			, load(load)
+			, checksummed(false)
+		{
+			file.seekg(0, std::ios::end);
+			data.resize((size_t) file.tellg());
+			file.seekg(0, std::ios::beg);
+		}
+
+		// fetches the trailing checksum chunk ahead of all others, hopping over chunk headers
+		void readChecksums()
+		{
+			auto hashId = DataHeader::make_id("hsum");
+			size_t offset = 0;
+			while (offset + sizeof(DataHeader) <= data.size())
+			{
+				DataHeader header;
+				file.seekg(offset);
+				if (!file.read(reinterpret_cast<char*>(&header), sizeof(header))
+					|| header.id == 0 || header.elementSize == 0 || header.size > data.size() - offset - sizeof(DataHeader))
+					break;
+				if (header.id == hashId && header.elementSize == sizeof(ChunkHash))
+				{
+					hashes.resize(header.size / sizeof(ChunkHash));
+					if (!file.read(reinterpret_cast<char*>(hashes.data()), sizeof(ChunkHash) * hashes.size()))
+						throwx( io_error("failed to read scene file") );
+					checksummed = true;
+					break;
+				}
+				chunkOffsets.push_back(offset);
+				offset += sizeof(DataHeader) + header.size;
+			}
+			file.clear();
+			file.seekg(0, std::ios::beg);
+
+			// passes if there are no checksums, as verify_checksums() does
+			if (checksummed && hashes.size() != chunkOffsets.size())
+				throwx( io_error("checksum count mismatch") );
+		}
+
+		// checks the complete chunk at the given offset against its stored checksum
+		void verify(size_t offset)
+		{
+			if (!checksummed)
+				return;
+			auto it = std::lower_bound(chunkOffsets.begin(), chunkOffsets.end(), offset);
+			if (it == chunkOffsets.end() || *it != offset)
+				throwx( io_error("chunk not covered by checksums") );
+
+			DataHeader header;
+			memcpy(&header, data.data() + offset, sizeof(header));
+			auto& hash = hashes[size_t(it - chunkOffsets.begin())];
+			if (hash.id != header.id || hash.hash != chunk_hash(data.data() + offset, sizeof(DataHeader) + header.size))
+				throwx( io_error("checksum mismatch") );
+		}
+
+		// makes sure the given range of bytes has arrived, clamped to the file size
+		void ensure(size_t end)
+		{
+			end = stdx::min_value(end, data.size());
+			while (loaded < end)
+			{
+				load.checkCancelled();
+				size_t blockSize = stdx::min_value(read_block_size, data.size() - loaded);
+				if (!file.read(data.data() + loaded, blockSize))
+					throwx( io_error("failed to read scene file") );
+				loaded += blockSize;
+				load.setProgress(float(loaded) / float(data.size()));
+			}
+		}
+	};
+
+	// forwards to ReadVisitor once the next chunk's bytes have arrived (& passed verification),
+	// publishing every chunk as soon as it has been read
+	struct AsyncReadVisitor
+	{
+		ReadVisitor<error_handler> read;
+		BlockReader& src;
+
+		AsyncReadVisitor(BlockReader& src)
+			: read(src.data.data(), src.data.data(), io_error_handlers::exception)
+			, src(src) { }
+
+		template <class Collection>
+		void operator ()(Collection& c, char const* id)
+		{
+			src.load.checkCancelled();
+
+			auto chunk = read.src;
+			size_t offset = size_t(chunk - src.data.data());
+			src.ensure(offset + sizeof(DataHeader));
+			if (src.loaded >= offset + sizeof(DataHeader))
+			{
+				DataHeader header;
+				memcpy(&header, chunk, sizeof(header));
+				// chunks of other ids are left alone by the read visitor
+				if (header.id == DataHeader::make_id(id))
+				{
+					src.ensure(offset + sizeof(DataHeader) + header.size);
+					if (src.loaded >= offset + sizeof(DataHeader) + header.size)
+						src.verify(offset);
+				}
+			}
+			read.srcEnd = src.data.data() + src.loaded;
+
+			read(c, id);
+			if (read.src == chunk)
+				return;
+
+			if (!is_deferred_chunk(id))
+			{
+				DataHeader header;
+				memcpy(&header, chunk, sizeof(header));
+				src.load.publish(id, header, reinterpret_cast<char const*>(c.data()));
+			}
+		}
+	};
+
+	template <class Collection>
+	void publish_collection(AsyncSceneLoad& load, Collection const& c, char const* id)
+	{
+		if (c.empty())
+			return;
+		auto header = DataHeader::make(id, c.size(), DataHeader::make_version(typename Collection::value_type()), sizeof(*c.data()));
+		load.publish(id, header, reinterpret_cast<char const*>(c.data()));
+	}
+}
+
+AsyncSceneLoad::AsyncSceneLoad(char const* path, appx::ConcurrentTask* task, read_mode::t mode)
+	: path(path)
+	, task(task)
+	, mode(mode)
+	, progressValue(0.0f)
+	, cancelRequested(false)
+{
+	std::packaged_task<Scene()> work([this]() { return load(); });
+	result = work.get_future();
+	loader = std::thread(MOVE(work));
+}
+
+AsyncSceneLoad::~AsyncSceneLoad()
+{
+	cancel();
+	if (loader.joinable())
+		loader.join();
+}
+
+bool AsyncSceneLoad::nextChunk(ReadyChunk& chunk)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (readyChunks.empty())
+		return false;
+	chunk = readyChunks.front();
+	readyChunks.pop_front();
+	return true;
+}
+
+void AsyncSceneLoad::publish(char const* id, DataHeader const& header, char const* data)
+{
+	ReadyChunk chunk;
+	memset(chunk.id, 0, sizeof(chunk.id));
+	strncpy(chunk.id, id, sizeof(chunk.id) - 1);
+	chunk.header = header;
+	chunk.data = stdx::make_range_n(data, header.size);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	readyChunks.push_back(chunk);
+}
+
+void AsyncSceneLoad::setProgress(float progress)
+{
+	progressValue.store(progress);
+	if (task)
+		task->progress(progress);
+}
+
+void AsyncSceneLoad::checkCancelled()
+{
+	if (cancelled())
+		throwx( io_error("scene loading cancelled") );
+}
+
+Scene AsyncSceneLoad::load()
+{
+	try
+	{
+		BlockReader src(path.c_str(), *this);
+		if (mode == read_mode::verify)
+			src.readChecksums();
+
+		AsyncReadVisitor v(src);
+		scene.reflect(scene, v);
+
+		complete_texture_pool(scene);
+		publish_collection(*this, scene.materials, "mat");
+		publish_collection(*this, scene.textures, "texp");
+	}
+	catch (...)
+	{
+		// chunks handed out already stay valid, the scene is kept until destruction
+		std::lock_guard<std::mutex> lock(mutex);
+		readyChunks.clear();
+		throw;
+	}
+
+	setProgress(1.0f);
+	return MOVE(scene);
+}
+
+} // namespace
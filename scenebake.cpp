@@ -0,0 +1,283 @@
+#include "scenebake"
+#include "scenelights"
+
+#include <cfloat>
+
+namespace scene
+{
+
+namespace
+{
+	typedef math::vec<float, 3> vec3;
+	typedef math::vec<float, 4> vec4;
+
+	// emitted & diffusely reflected radiance leaving the hit point towards the ray origin,
+	// emission is gathered by next-event estimation instead where the scene has a light BVH
+	template <class Scene>
+	vec3 radiance(Scene const& scene, TriangleBvh const& bvh, math::ray<vec3> const& ray, BvhHit const& hit
+		, BakeParams const& params, SampleRandom& random, unsigned bounces)
+	{
+		auto surface = surface_point(scene, bvh, ray, hit);
+		auto& material = surface_material(scene, surface);
+		bool lights = !scene.lightNodes.empty();
+		vec3 L = (lights) ? vec3(0.0f) : vec3(material.emissive);
+
+		if (bounces > 0)
+		{
+			if (lights)
+				L += material.diffuse * sample_direct_light(scene, bvh, surface.position, surface.shadingNormal, params.rayOffset, random);
+
+			math::ray<vec3> next;
+			next.o = surface.position + params.rayOffset * surface.normal;
+			float u1 = random.uniform(), u2 = random.uniform();
+			next.d = sample_cosine_hemisphere(surface.shadingNormal, u1, u2);
+			if (dot(next.d, surface.normal) > 0.0f)
+			{
+				BvhHit nextHit;
+				vec3 Li = (bvh.intersect(next, FLT_MAX, nextHit))
+					? radiance(scene, bvh, next, nextHit, params, random, bounces - 1)
+					: params.skyRadiance;
+				L += material.diffuse * Li;
+			}
+		}
+
+		return L;
+	}
+
+	// object-space vertex normals, from area-weighted face normals if the scene has none
+	template <class Scene>
+	std::vector<vec3> face_vertex_normals(Scene const& scene)
+	{
+		std::vector<vec3> normals(scene.positions.size(), vec3(0.0f));
+		for (auto& mesh : scene.meshes)
+			for (unsigned p = mesh.primitives.first; p + 3 <= mesh.primitives.last; p += 3)
+			{
+				unsigned i0 = scene.indices[p], i1 = scene.indices[p + 1], i2 = scene.indices[p + 2];
+				vec3 n = cross(scene.positions[i1] - scene.positions[i0], scene.positions[i2] - scene.positions[i0]);
+				normals[i0] += n;
+				normals[i1] += n;
+				normals[i2] += n;
+			}
+		return normals;
+	}
+
+	struct LightmapTexel
+	{
+		unsigned primitive; // ~0 if not covered
+		float u, v;
+	};
+
+	// fills uncovered texels with the average of covered neighbors, such that bilinear lookups do not bleed black at seams
+	void dilate(img::Image<float>& image, std::vector<unsigned char>& covered, unsigned passes)
+	{
+		int w = int(image.dim.x), h = int(image.dim.y);
+		for (unsigned pass = 0; pass < passes; ++pass)
+		{
+			auto coveredBefore = covered;
+			for (int y = 0; y < h; ++y)
+				for (int x = 0; x < w; ++x)
+				{
+					if (coveredBefore[y * w + x])
+						continue;
+
+					vec4 sum(0.0f);
+					int n = 0;
+					int const offsets[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+					for (auto& o : offsets)
+					{
+						int nx = x + o[0], ny = y + o[1];
+						if (nx < 0 || ny < 0 || nx >= w || ny >= h || !coveredBefore[ny * w + nx])
+							continue;
+						for (int c = 0; c < 4; ++c)
+							sum[c] += image.pixels[4 * (ny * w + nx) + c];
+						++n;
+					}
+					if (n)
+					{
+						for (int c = 0; c < 4; ++c)
+							image.pixels[4 * (y * w + x) + c] = sum[c] / float(n);
+						covered[y * w + x] = true;
+					}
+				}
+		}
+	}
+
+} // namespace
+
+template <class Scene>
+vec4 bake_point(Scene const& scene, TriangleBvh const& bvh, vec3 const& position, vec3 const& normal
+	, BakeParams const& params, SampleRandom& random)
+{
+	vec3 light(0.0f);
+	float unoccluded = 0.0f;
+
+	math::ray<vec3> ray;
+	ray.o = position + params.rayOffset * normal;
+	for (unsigned s = 0; s < params.samples; ++s)
+	{
+		light += sample_direct_light(scene, bvh, position, normal, params.rayOffset, random);
+
+		float u1 = random.uniform(), u2 = random.uniform();
+		ray.d = sample_cosine_hemisphere(normal, u1, u2);
+
+		BvhHit hit;
+		if (!bvh.intersect(ray, FLT_MAX, hit))
+		{
+			light += params.skyRadiance;
+			unoccluded += 1.0f;
+			continue;
+		}
+
+		if (hit.t > params.aoDistance)
+			unoccluded += 1.0f;
+		light += radiance(scene, bvh, ray, hit, params, random, params.bounces);
+	}
+
+	float weight = (params.samples) ? 1.0f / float(params.samples) : 0.0f;
+	return vec4(light * weight, unoccluded * weight);
+}
+
+template <class Scene>
+VertexBakeSource prepare_vertex_bake(Scene const& scene)
+{
+	VertexBakeSource source;
+	source.instances.assign(scene.positions.size(), ~0U);
+	for (unsigned i = 0, ie = unsigned(scene.instances.size()); i < ie; ++i)
+	{
+		auto prims = scene.meshes[scene.instances[i].mesh].primitives;
+		for (auto p = prims.first; p < prims.last; ++p)
+		{
+			auto& vi = source.instances[scene.indices[p]];
+			if (vi == ~0U)
+				vi = i;
+		}
+	}
+
+	if (scene.normals.size() != scene.positions.size())
+		source.normals = face_vertex_normals(scene);
+	return source;
+}
+
+template <class Scene>
+void bake_vertices(Scene const& scene, TriangleBvh const& bvh, VertexBakeSource const& source, BakeParams const& params
+	, size_t begin, size_t end, vec4* dest)
+{
+	for (size_t v = begin; v < end; ++v)
+	{
+		dest[v - begin] = vec4(0.0f);
+		if (source.instances[v] == ~0U)
+			continue;
+
+		auto& transform = scene.instances[source.instances[v]].transform;
+		vec3 position = transform * vec4(scene.positions[v], 1.0f);
+		vec3 normal = transform_normal(transform, (source.normals.empty()) ? scene.normals[v] : source.normals[v]);
+		float len = length(normal);
+		if (!(len > 0.0f))
+			continue;
+
+		SampleRandom random(params.seed * 0x100000001B3ULL + v);
+		dest[v - begin] = bake_point(scene, bvh, position, normal / len, params, random);
+	}
+}
+
+void bake_vertex_lighting(Scene& scene, TriangleBvh const& bvh, BakeParams const& params)
+{
+	auto source = prepare_vertex_bake(scene);
+	scene.vertexLighting.resize(scene.positions.size());
+	stdx::parallel_for(scene.positions.size(), 64, [&](size_t begin, size_t end)
+	{
+		bake_vertices(scene, bvh, source, params, begin, end, scene.vertexLighting.data() + begin);
+	});
+}
+
+template <class Scene>
+img::Image<float> bake_lightmap(Scene const& scene, TriangleBvh const& bvh, unsigned instance, glm::uvec2 resolution, BakeParams const& params)
+{
+	if (scene.texcoords.size() != scene.positions.size())
+		throwx( io_error("lightmap baking requires texture coordinates") );
+
+	img::ImageDesc desc;
+	desc.channels = 4;
+	desc.dim = glm::uvec3(resolution, 1);
+	img::Image<float> image(desc);
+
+	int w = int(resolution.x), h = int(resolution.y);
+	LightmapTexel const uncovered = { ~0U, 0.0f, 0.0f };
+	std::vector<LightmapTexel> texels(w * h, uncovered);
+
+	// rasterize texel centers in texture space, row y at v = (y + 0.5) / height
+	auto& inst = scene.instances[instance];
+	auto prims = scene.meshes[inst.mesh].primitives;
+	auto scale = math::vec<float, 2>(float(w), float(h));
+	for (unsigned p = prims.first; p + 3 <= prims.last; p += 3)
+	{
+		auto t0 = scene.texcoords[scene.indices[p]] * scale;
+		auto t1 = scene.texcoords[scene.indices[p + 1]] * scale;
+		auto t2 = scene.texcoords[scene.indices[p + 2]] * scale;
+		float area = (t1.x - t0.x) * (t2.y - t0.y) - (t2.x - t0.x) * (t1.y - t0.y);
+		if (area == 0.0f)
+			continue;
+
+		int x0 = math::max(int(floor(math::min(t0.x, math::min(t1.x, t2.x)))), 0);
+		int y0 = math::max(int(floor(math::min(t0.y, math::min(t1.y, t2.y)))), 0);
+		int x1 = math::min(int(ceil(math::max(t0.x, math::max(t1.x, t2.x)))), w - 1);
+		int y1 = math::min(int(ceil(math::max(t0.y, math::max(t1.y, t2.y)))), h - 1);
+		for (int y = y0; y <= y1; ++y)
+			for (int x = x0; x <= x1; ++x)
+			{
+				float px = float(x) + 0.5f, py = float(y) + 0.5f;
+				float b1 = ((px - t0.x) * (t2.y - t0.y) - (t2.x - t0.x) * (py - t0.y)) / area;
+				float b2 = ((t1.x - t0.x) * (py - t0.y) - (px - t0.x) * (t1.y - t0.y)) / area;
+				if (b1 < 0.0f || b2 < 0.0f || b1 + b2 > 1.0f)
+					continue;
+				LightmapTexel texel = { p, b1, b2 };
+				texels[y * w + x] = texel;
+			}
+	}
+
+	std::vector<unsigned char> covered(w * h);
+	stdx::parallel_for(size_t(h), 1, [&](size_t begin, size_t end)
+	{
+		for (size_t y = begin; y < end; ++y)
+			for (int x = 0; x < w; ++x)
+			{
+				size_t idx = y * w + x;
+				auto& texel = texels[idx];
+				if (texel.primitive == ~0U)
+					continue;
+
+				unsigned i0 = scene.indices[texel.primitive], i1 = scene.indices[texel.primitive + 1], i2 = scene.indices[texel.primitive + 2];
+				float b0 = 1.0f - texel.u - texel.v;
+				vec3 position = b0 * scene.positions[i0] + texel.u * scene.positions[i1] + texel.v * scene.positions[i2];
+				vec3 normal = (scene.normals.size() == scene.positions.size())
+					? b0 * scene.normals[i0] + texel.u * scene.normals[i1] + texel.v * scene.normals[i2]
+					: cross(scene.positions[i1] - scene.positions[i0], scene.positions[i2] - scene.positions[i0]);
+
+				position = inst.transform * vec4(position, 1.0f);
+				normal = transform_normal(inst.transform, normal);
+				float len = length(normal);
+				if (!(len > 0.0f))
+					continue;
+
+				SampleRandom random(params.seed * 0x100000001B3ULL + idx);
+				vec4 result = bake_point(scene, bvh, position, normal / len, params, random);
+				for (int c = 0; c < 4; ++c)
+					image.pixels[4 * idx + c] = result[c];
+				covered[idx] = true;
+			}
+	});
+
+	dilate(image, covered, 2);
+	return image;
+}
+
+template vec4 bake_point(Scene const& scene, TriangleBvh const& bvh, vec3 const& position, vec3 const& normal, BakeParams const& params, SampleRandom& random);
+template vec4 bake_point(ExternalScene const& scene, TriangleBvh const& bvh, vec3 const& position, vec3 const& normal, BakeParams const& params, SampleRandom& random);
+template VertexBakeSource prepare_vertex_bake(Scene const& scene);
+template VertexBakeSource prepare_vertex_bake(ExternalScene const& scene);
+template void bake_vertices(Scene const& scene, TriangleBvh const& bvh, VertexBakeSource const& source, BakeParams const& params, size_t begin, size_t end, vec4* dest);
+template void bake_vertices(ExternalScene const& scene, TriangleBvh const& bvh, VertexBakeSource const& source, BakeParams const& params, size_t begin, size_t end, vec4* dest);
+template img::Image<float> bake_lightmap(Scene const& scene, TriangleBvh const& bvh, unsigned instance, glm::uvec2 resolution, BakeParams const& params);
+template img::Image<float> bake_lightmap(ExternalScene const& scene, TriangleBvh const& bvh, unsigned instance, glm::uvec2 resolution, BakeParams const& params);
+
+} // namespace
@@ -0,0 +1,130 @@
+#include "scenebounds"
+
+#include <cfloat>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define SCENE_BOUNDS_SSE
+	#include <xmmintrin.h>
+#endif
+
+namespace scene
+{
+
+namespace
+{
+	typedef math::aabb< math::vec<float, 3> > box3;
+
+#ifdef SCENE_BOUNDS_SSE
+	inline __m128 load_vec3(float const* p)
+	{
+		return _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<__m64 const*>(p)), _mm_load_ss(p + 2));
+	}
+
+	inline math::vec<float, 3> store_vec3(__m128 v)
+	{
+		float r[4];
+		_mm_storeu_ps(r, v);
+		return math::vec<float, 3>(r[0], r[1], r[2]);
+	}
+#endif
+}
+
+box3 empty_bounds()
+{
+	box3 box;
+	box.min = math::vec<float, 3>(FLT_MAX);
+	box.max = math::vec<float, 3>(-FLT_MAX);
+	return box;
+}
+
+box3 union_bounds(box3 const& a, box3 const& b)
+{
+	box3 box;
+	box.min = min(a.min, b.min);
+	box.max = max(a.max, b.max);
+	return box;
+}
+
+box3 indexed_bounds(math::vec<float, 3> const* positions, size_t positionCount, unsigned const* indices, size_t count)
+{
+#ifdef SCENE_BOUNDS_SSE
+	auto p = reinterpret_cast<float const*>(positions);
+	size_t stride = sizeof(*positions) / sizeof(float);
+
+	// two independent accumulators to hide min/max latency
+	__m128 lo0 = _mm_set1_ps(FLT_MAX), lo1 = lo0;
+	__m128 hi0 = _mm_set1_ps(-FLT_MAX), hi1 = hi0;
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2)
+	{
+		auto i0 = indices[i], i1 = indices[i + 1];
+		assert (i0 < positionCount && i1 < positionCount);
+		__m128 v0 = load_vec3(p + stride * i0);
+		__m128 v1 = load_vec3(p + stride * i1);
+		lo0 = _mm_min_ps(lo0, v0);
+		hi0 = _mm_max_ps(hi0, v0);
+		lo1 = _mm_min_ps(lo1, v1);
+		hi1 = _mm_max_ps(hi1, v1);
+	}
+	if (i < count)
+	{
+		assert (indices[i] < positionCount);
+		__m128 v = load_vec3(p + stride * indices[i]);
+		lo0 = _mm_min_ps(lo0, v);
+		hi0 = _mm_max_ps(hi0, v);
+	}
+
+	box3 box;
+	box.min = store_vec3(_mm_min_ps(lo0, lo1));
+	box.max = store_vec3(_mm_max_ps(hi0, hi1));
+	return box;
+#else
+	auto box = empty_bounds();
+	for (size_t i = 0; i < count; ++i)
+	{
+		assert (indices[i] < positionCount);
+		auto& v = positions[indices[i]];
+		box.min = min(box.min, v);
+		box.max = max(box.max, v);
+	}
+	return box;
+#endif
+}
+
+box3 transform_bounds(math::mat4x3 const& transform, box3 const& box)
+{
+	float const* columns[3] = { &transform.a.x, &transform.b.x, &transform.c.x };
+	float const* boxMin = &box.min.x;
+	float const* boxMax = &box.max.x;
+
+#ifdef SCENE_BOUNDS_SSE
+	__m128 lo = load_vec3(&transform.d.x), hi = lo;
+	for (int j = 0; j < 3; ++j)
+	{
+		__m128 column = load_vec3(columns[j]);
+		__m128 e = _mm_mul_ps(column, _mm_set1_ps(boxMin[j]));
+		__m128 f = _mm_mul_ps(column, _mm_set1_ps(boxMax[j]));
+		lo = _mm_add_ps(lo, _mm_min_ps(e, f));
+		hi = _mm_add_ps(hi, _mm_max_ps(e, f));
+	}
+
+	box3 result;
+	result.min = store_vec3(lo);
+	result.max = store_vec3(hi);
+	return result;
+#else
+	box3 result;
+	result.min = result.max = transform.d;
+	for (int j = 0; j < 3; ++j)
+		for (int i = 0; i < 3; ++i)
+		{
+			float e = columns[j][i] * boxMin[j];
+			float f = columns[j][i] * boxMax[j];
+			result.min[i] += math::min(e, f);
+			result.max[i] += math::max(e, f);
+		}
+	return result;
+#endif
+}
+
+} // namespace
@@ -0,0 +1,429 @@
+#include "scenebvh"
+
+#include <cfloat>
+#include <algorithm>
+
+namespace scene
+{
+
+namespace
+{
+	typedef math::vec<float, 3> vec3;
+	typedef math::aabb<vec3> box3;
+
+	unsigned const bin_count = 16;
+	unsigned const min_leaf_size = 2;
+	unsigned const max_leaf_size = 16;
+	float const traversal_cost = 1.0f;
+
+	box3 empty_box()
+	{
+		box3 box;
+		box.min = vec3(FLT_MAX);
+		box.max = vec3(-FLT_MAX);
+		return box;
+	}
+
+	void grow(box3& box, box3 const& other)
+	{
+		box.min = min(box.min, other.min);
+		box.max = max(box.max, other.max);
+	}
+
+	void grow(box3& box, vec3 const& p)
+	{
+		box.min = min(box.min, p);
+		box.max = max(box.max, p);
+	}
+
+	float half_area(box3 const& box)
+	{
+		if (!(box.min.x <= box.max.x))
+			return 0.0f;
+		vec3 e = box.max - box.min;
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+
+	struct BuildTask
+	{
+		unsigned node;
+		unsigned begin, end;
+		unsigned depth;
+	};
+
+	struct Builder
+	{
+		std::vector<box3> const& bounds;
+		std::vector<vec3> const& centroids;
+		std::vector<unsigned>& order;
+
+		Builder(std::vector<box3> const& bounds, std::vector<vec3> const& centroids, std::vector<unsigned>& order)
+			: bounds(bounds)
+			, centroids(centroids)
+			, order(order) { }
+
+		// binned SAH over centroids, returns false if a leaf is cheaper
+		bool split(unsigned begin, unsigned end, box3 const& nodeBounds, unsigned& mid)
+		{
+			unsigned count = end - begin;
+			if (count <= min_leaf_size)
+				return false;
+
+			box3 centroidBounds = empty_box();
+			for (unsigned i = begin; i < end; ++i)
+				grow(centroidBounds, centroids[order[i]]);
+
+			float bestCost = FLT_MAX;
+			int bestAxis = -1;
+			unsigned bestBin = 0;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				float lo = centroidBounds.min[axis], extent = centroidBounds.max[axis] - lo;
+				if (!(extent > 0.0f))
+					continue;
+				float scale = float(bin_count) / extent;
+
+				box3 binBounds[bin_count];
+				unsigned binCounts[bin_count] = { 0 };
+				for (auto& b : binBounds) b = empty_box();
+				for (unsigned i = begin; i < end; ++i)
+				{
+					auto t = order[i];
+					unsigned bin = math::min(unsigned((centroids[t][axis] - lo) * scale), bin_count - 1);
+					++binCounts[bin];
+					grow(binBounds[bin], bounds[t]);
+				}
+
+				// right-to-left sweep, then evaluate left-to-right
+				float rightAreas[bin_count];
+				unsigned rightCounts[bin_count];
+				box3 acc = empty_box();
+				unsigned accCount = 0;
+				for (unsigned b = bin_count; b-- > 1; )
+				{
+					grow(acc, binBounds[b]);
+					accCount += binCounts[b];
+					rightAreas[b] = half_area(acc);
+					rightCounts[b] = accCount;
+				}
+				acc = empty_box();
+				accCount = 0;
+				for (unsigned b = 1; b < bin_count; ++b)
+				{
+					grow(acc, binBounds[b - 1]);
+					accCount += binCounts[b - 1];
+					float cost = half_area(acc) * float(accCount) + rightAreas[b] * float(rightCounts[b]);
+					if (accCount && rightCounts[b] && cost < bestCost)
+					{
+						bestCost = cost;
+						bestAxis = axis;
+						bestBin = b;
+					}
+				}
+			}
+
+			float area = half_area(nodeBounds);
+			float leafCost = float(count);
+			float splitCost = traversal_cost + ((area > 0.0f) ? bestCost / area : 0.0f);
+
+			if (bestAxis < 0)
+			{
+				// coincident centroids, fall back to an object median split
+				if (count <= max_leaf_size)
+					return false;
+				mid = begin + count / 2;
+				return true;
+			}
+			if (count <= max_leaf_size && leafCost <= splitCost)
+				return false;
+
+			float lo = centroidBounds.min[bestAxis];
+			float scale = float(bin_count) / (centroidBounds.max[bestAxis] - lo);
+			auto it = std::partition(order.begin() + begin, order.begin() + end, [&](unsigned t)
+			{
+				return math::min(unsigned((centroids[t][bestAxis] - lo) * scale), bin_count - 1) < bestBin;
+			});
+			mid = unsigned(it - order.begin());
+			return true;
+		}
+
+		box3 rangeBounds(unsigned begin, unsigned end) const
+		{
+			box3 box = empty_box();
+			for (unsigned i = begin; i < end; ++i)
+				grow(box, bounds[order[i]]);
+			return box;
+		}
+
+		// builds the subtree of the given (allocated) node, hands large ranges to tasks if given
+		void build(std::vector<BvhNode>& nodes, unsigned nodeIdx, unsigned begin, unsigned end, unsigned depth, std::vector<BuildTask>* tasks, unsigned taskSize)
+		{
+			nodes[nodeIdx].bounds = rangeBounds(begin, end);
+
+			if (tasks && end - begin <= taskSize)
+			{
+				BuildTask task = { nodeIdx, begin, end, depth };
+				tasks->push_back(task);
+				return;
+			}
+
+			// degenerate inputs may split unevenly forever, large leaves keep traversal stacks bounded
+			unsigned mid;
+			if (depth + 1 >= bvh_max_depth || !split(begin, end, nodes[nodeIdx].bounds, mid))
+			{
+				nodes[nodeIdx].first = begin;
+				nodes[nodeIdx].count = end - begin;
+				return;
+			}
+
+			unsigned left = unsigned(nodes.size());
+			nodes.resize(nodes.size() + 2);
+			nodes[nodeIdx].first = left;
+			nodes[nodeIdx].count = 0;
+			build(nodes, left, begin, mid, depth + 1, tasks, taskSize);
+			build(nodes, left + 1, mid, end, depth + 1, tasks, taskSize);
+		}
+	};
+
+	bool intersect_box(box3 const& box, vec3 const& origin, vec3 const& invDir, float tMax, float& tEntry)
+	{
+		vec3 t0 = (box.min - origin) * invDir;
+		vec3 t1 = (box.max - origin) * invDir;
+		vec3 tNear = min(t0, t1), tFar = max(t0, t1);
+		float tn = math::max(math::max(tNear.x, tNear.y), math::max(tNear.z, 0.0f));
+		float tf = math::min(math::min(tFar.x, tFar.y), math::min(tFar.z, tMax));
+		tEntry = tn;
+		return tn <= tf;
+	}
+
+	bool intersect_triangle(BvhTriangle const& tri, vec3 const& origin, vec3 const& dir, float tMax, float& t, float& u, float& v)
+	{
+		vec3 p = cross(dir, tri.e2);
+		float det = dot(tri.e1, p);
+		if (det == 0.0f)
+			return false;
+		float invDet = 1.0f / det;
+		vec3 s = origin - tri.v0;
+		u = dot(s, p) * invDet;
+		if (u < 0.0f || u > 1.0f)
+			return false;
+		vec3 q = cross(s, tri.e1);
+		v = dot(dir, q) * invDet;
+		if (v < 0.0f || u + v > 1.0f)
+			return false;
+		t = dot(tri.e2, q) * invDet;
+		return t > 0.0f && t < tMax;
+	}
+
+	template <bool AnyHit>
+	bool traverse(TriangleBvh const& bvh, math::ray<vec3> const& ray, float tMax, BvhHit* hit)
+	{
+		if (bvh.nodes.empty())
+			return false;
+
+		vec3 invDir = vec3(1.0f) / ray.d;
+		bool found = false;
+
+		unsigned stack[bvh_max_depth];
+		unsigned stackSize = 0;
+		unsigned nodeIdx = 0;
+		float tEntry;
+		if (!intersect_box(bvh.nodes[0].bounds, ray.o, invDir, tMax, tEntry))
+			return false;
+
+		while (true)
+		{
+			auto& node = bvh.nodes[nodeIdx];
+			if (node.count)
+			{
+				for (unsigned i = node.first, ie = node.first + node.count; i < ie; ++i)
+				{
+					float t, u, v;
+					if (intersect_triangle(bvh.triangles[i], ray.o, ray.d, tMax, t, u, v))
+					{
+						if (AnyHit)
+							return true;
+						tMax = t;
+						hit->t = t;
+						hit->u = u;
+						hit->v = v;
+						hit->triangle = i;
+						found = true;
+					}
+				}
+			}
+			else
+			{
+				float tLeft, tRight;
+				bool left = intersect_box(bvh.nodes[node.first].bounds, ray.o, invDir, tMax, tLeft);
+				bool right = intersect_box(bvh.nodes[node.first + 1].bounds, ray.o, invDir, tMax, tRight);
+				if (left && right)
+				{
+					// nearer child first
+					unsigned nearIdx = node.first, farIdx = node.first + 1;
+					if (tRight < tLeft)
+						std::swap(nearIdx, farIdx);
+					assert (stackSize < arraylen(stack));
+					stack[stackSize++] = farIdx;
+					nodeIdx = nearIdx;
+					continue;
+				}
+				else if (left || right)
+				{
+					nodeIdx = (left) ? node.first : node.first + 1;
+					continue;
+				}
+			}
+
+			if (!stackSize)
+				break;
+			nodeIdx = stack[--stackSize];
+		}
+
+		return found;
+	}
+
+} // namespace
+
+bool TriangleBvh::intersect(math::ray<vec3> const& ray, float tMax, BvhHit& hit) const
+{
+	return traverse<false>(*this, ray, tMax, &hit);
+}
+
+bool TriangleBvh::occluded(math::ray<vec3> const& ray, float tMax) const
+{
+	return traverse<true>(*this, ray, tMax, nullptr);
+}
+
+template <class Scene>
+TriangleBvh build_bvh(Scene const& scene)
+{
+	TriangleBvh bvh;
+
+	// world-space triangles of all instances
+	std::vector<size_t> firstTriangles(scene.instances.size() + 1);
+	for (size_t i = 0; i < scene.instances.size(); ++i)
+	{
+		auto prims = scene.meshes[scene.instances[i].mesh].primitives;
+		firstTriangles[i + 1] = firstTriangles[i] + (prims.last - prims.first) / 3;
+	}
+	size_t triangleCount = firstTriangles.back();
+	if (!triangleCount)
+		return bvh;
+
+	std::vector<BvhTriangle> triangles(triangleCount);
+	std::vector<box3> bounds(triangleCount);
+	std::vector<vec3> centroids(triangleCount);
+	stdx::parallel_for(scene.instances.size(), 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			auto& inst = scene.instances[i];
+			auto prims = scene.meshes[inst.mesh].primitives;
+			size_t t = firstTriangles[i];
+			for (unsigned p = prims.first; p + 3 <= prims.last; p += 3, ++t)
+			{
+				vec3 v0 = inst.transform * math::vec<float, 4>(scene.positions[scene.indices[p]], 1.0f);
+				vec3 v1 = inst.transform * math::vec<float, 4>(scene.positions[scene.indices[p + 1]], 1.0f);
+				vec3 v2 = inst.transform * math::vec<float, 4>(scene.positions[scene.indices[p + 2]], 1.0f);
+
+				auto& tri = triangles[t];
+				tri.v0 = v0;
+				tri.e1 = v1 - v0;
+				tri.e2 = v2 - v0;
+				tri.instance = unsigned(i);
+				tri.primitive = p;
+
+				box3 box = empty_box();
+				grow(box, v0);
+				grow(box, v1);
+				grow(box, v2);
+				bounds[t] = box;
+				centroids[t] = (box.min + box.max) * 0.5f;
+			}
+		}
+	});
+
+	std::vector<unsigned> order(triangleCount);
+	for (unsigned i = 0; i < unsigned(triangleCount); ++i)
+		order[i] = i;
+
+	// top levels sequentially, then independent subtrees in parallel
+	Builder builder(bounds, centroids, order);
+	std::vector<BuildTask> tasks;
+	unsigned taskSize = unsigned(math::max(triangleCount / (8 * stdx::hardware_threads()), size_t(1024)));
+	bvh.nodes.resize(1);
+	builder.build(bvh.nodes, 0, 0, unsigned(triangleCount), 0, &tasks, taskSize);
+
+	std::vector< std::vector<BvhNode> > subtrees(tasks.size());
+	stdx::parallel_for(tasks.size(), 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			subtrees[i].resize(1);
+			builder.build(subtrees[i], 0, tasks[i].begin, tasks[i].end, tasks[i].depth, nullptr, 0);
+		}
+	});
+
+	// splice subtrees, local node k > 0 moves to base + k - 1
+	for (size_t i = 0; i < tasks.size(); ++i)
+	{
+		auto& subtree = subtrees[i];
+		unsigned base = unsigned(bvh.nodes.size());
+		for (auto& node : subtree)
+			if (!node.count)
+				node.first += base - 1;
+		bvh.nodes[tasks[i].node] = subtree[0];
+		bvh.nodes.insert(bvh.nodes.end(), subtree.begin() + 1, subtree.end());
+	}
+
+	bvh.triangles.resize(triangleCount);
+	for (size_t i = 0; i < triangleCount; ++i)
+		bvh.triangles[i] = triangles[order[i]];
+
+	return bvh;
+}
+
+template <class Scene>
+SurfacePoint surface_point(Scene const& scene, TriangleBvh const& bvh, math::ray<vec3> const& ray, BvhHit const& hit)
+{
+	auto& tri = bvh.triangles[hit.triangle];
+	auto& inst = scene.instances[tri.instance];
+	unsigned i0 = scene.indices[tri.primitive], i1 = scene.indices[tri.primitive + 1], i2 = scene.indices[tri.primitive + 2];
+	float w = 1.0f - hit.u - hit.v;
+
+	SurfacePoint s;
+	s.position = tri.v0 + hit.u * tri.e1 + hit.v * tri.e2;
+	s.instance = tri.instance;
+	s.material = scene.meshes[inst.mesh].material;
+
+	s.normal = normalize(cross(tri.e1, tri.e2));
+	if (dot(s.normal, ray.d) > 0.0f)
+		s.normal = -s.normal;
+
+	s.shadingNormal = s.normal;
+	if (scene.normals.size() == scene.positions.size())
+	{
+		vec3 n = w * scene.normals[i0] + hit.u * scene.normals[i1] + hit.v * scene.normals[i2];
+		n = transform_normal(inst.transform, n);
+		float len = length(n);
+		if (len > 0.0f)
+		{
+			n /= len;
+			s.shadingNormal = (dot(n, s.normal) < 0.0f) ? -n : n;
+		}
+	}
+
+	s.texcoord = math::vec<float, 2>(0.0f);
+	if (scene.texcoords.size() == scene.positions.size())
+		s.texcoord = w * scene.texcoords[i0] + hit.u * scene.texcoords[i1] + hit.v * scene.texcoords[i2];
+
+	return s;
+}
+
+template TriangleBvh build_bvh(Scene const& scene);
+template TriangleBvh build_bvh(ExternalScene const& scene);
+template SurfacePoint surface_point(Scene const& scene, TriangleBvh const& bvh, math::ray<vec3> const& ray, BvhHit const& hit);
+template SurfacePoint surface_point(ExternalScene const& scene, TriangleBvh const& bvh, math::ray<vec3> const& ray, BvhHit const& hit);
+
+} // namespace
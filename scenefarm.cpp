@@ -0,0 +1,534 @@
+#include "scenefarm"
+#include "scenex"
+#include "parallel"
+
+#include <algorithm>
+#include <deque>
+#include <chrono>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace scene
+{
+
+namespace
+{
+	typedef math::vec<float, 4> vec4;
+
+	struct message_type
+	{
+		enum t
+		{
+			init,   // coordinator -> worker: InitJob, scene path
+			trace,  // coordinator -> worker: TraceJob
+			bake,   // coordinator -> worker: BakeJob
+			result, // worker -> coordinator: result floats
+			quit    // coordinator -> worker
+		};
+	};
+
+	struct MessageHeader
+	{
+		unsigned type;
+		unsigned size; // payload
+		unsigned long long job;
+	};
+
+	struct InitJob
+	{
+		unsigned threads;
+	};
+
+	struct TraceJob
+	{
+		math::mat4 viewProjInverse;
+		glm::uvec2 resolution;
+		glm::uvec2 begin, end;
+		unsigned long long firstPass;
+		unsigned passes;
+		TraceParams params;
+	};
+
+	struct BakeJob
+	{
+		unsigned long long begin, end;
+		BakeParams params;
+	};
+
+	bool send_all(int socket, void const* data, size_t size)
+	{
+		auto bytes = static_cast<char const*>(data);
+		while (size > 0)
+		{
+#ifdef MSG_NOSIGNAL
+			auto sent = ::send(socket, bytes, size, MSG_NOSIGNAL);
+#else
+			auto sent = ::send(socket, bytes, size, 0);
+#endif
+			if (sent < 0 && errno == EINTR)
+				continue;
+			if (sent <= 0)
+				return false;
+			bytes += sent;
+			size -= size_t(sent);
+		}
+		return true;
+	}
+
+	bool recv_all(int socket, void* data, size_t size)
+	{
+		auto bytes = static_cast<char*>(data);
+		while (size > 0)
+		{
+			auto received = ::recv(socket, bytes, size, 0);
+			if (received < 0 && errno == EINTR)
+				continue;
+			if (received <= 0)
+				return false;
+			bytes += received;
+			size -= size_t(received);
+		}
+		return true;
+	}
+
+	bool send_message(int socket, message_type::t type, unsigned long long job, void const* payload = nullptr, size_t size = 0
+		, void const* payload2 = nullptr, size_t size2 = 0)
+	{
+		MessageHeader header = { unsigned(type), unsigned(size + size2), job };
+		return send_all(socket, &header, sizeof(header))
+			&& send_all(socket, payload, size)
+			&& send_all(socket, payload2, size2);
+	}
+
+	bool recv_message(int socket, MessageHeader& header, std::vector<char>& payload)
+	{
+		if (!recv_all(socket, &header, sizeof(header)))
+			return false;
+		payload.resize(header.size);
+		return recv_all(socket, payload.data(), header.size);
+	}
+
+	sockaddr_un make_address(char const* path)
+	{
+		sockaddr_un address = sockaddr_un();
+		address.sun_family = AF_UNIX;
+		if (strlen(path) >= sizeof(address.sun_path))
+			throwx( farm_error("socket path too long") );
+		strcpy(address.sun_path, path);
+		return address;
+	}
+
+	// collects the chunk ranges of a scene, then points the chunks of a scene view at them in the same order
+	struct ViewVisitor
+	{
+		std::vector< std::pair<void const*, size_t> > chunks;
+		size_t next;
+
+		ViewVisitor() : next(0) { }
+
+		template <class Collection>
+		void operator ()(Collection const& c, char const*)
+		{
+			chunks.push_back( std::make_pair(static_cast<void const*>(c.data()), c.size()) );
+		}
+		template <class T>
+		void operator ()(stdx::range<T const*>& view, char const*)
+		{
+			auto& chunk = chunks[next++];
+			view = stdx::make_range_n(static_cast<T const*>(chunk.first), chunk.second);
+		}
+	};
+
+	ExternalScene make_scene_view(Scene const& scene)
+	{
+		ViewVisitor v;
+		scene.reflect(scene, v);
+		ExternalScene view;
+		view.reflect(view, v);
+		return view;
+	}
+
+	// serves jobs on the given scene until the connection closes or the coordinator says quit
+	unsigned serve_jobs(int socket)
+	{
+		MessageHeader header;
+		std::vector<char> payload;
+		if (!recv_message(socket, header, payload) || header.type != message_type::init || payload.size() < sizeof(InitJob))
+			throwx( farm_error("expected farm init message") );
+
+		auto init = *reinterpret_cast<InitJob const*>(payload.data());
+		std::string scenePath(payload.data() + sizeof(InitJob), payload.size() - sizeof(InitJob));
+
+		// the coordinator verified the file already
+		stdx::mapped_file file(scenePath.c_str(), 0, stdx::file_flags::read, stdx::file_flags::existing, stdx::file_flags::read, stdx::file_flags::random);
+		auto scene = map_scene(file.crange(), io_error_handlers::exception, read_mode::trusted);
+		auto bvh = build_bvh(scene);
+
+		VertexBakeSource bakeSource;
+		bool bakePrepared = false;
+
+		unsigned served = 0;
+		std::vector<float> result;
+		while (recv_message(socket, header, payload) && header.type != message_type::quit)
+		{
+			if (header.type == message_type::trace && payload.size() == sizeof(TraceJob))
+			{
+				auto& job = *reinterpret_cast<TraceJob const*>(payload.data());
+				auto dim = job.end - job.begin;
+				result.assign(4 * size_t(dim.x) * dim.y, 0.0f);
+				for (unsigned p = 0; p < job.passes; ++p)
+					stdx::parallel_for(dim.y, 1, [&](size_t begin, size_t end)
+					{
+						trace_tile(scene, bvh, job.viewProjInverse, job.resolution
+							, glm::uvec2(job.begin.x, job.begin.y + unsigned(begin)), glm::uvec2(job.end.x, job.begin.y + unsigned(end))
+							, job.firstPass + p, job.params, &result[4 * begin * dim.x], dim.x);
+					}, init.threads);
+			}
+			else if (header.type == message_type::bake && payload.size() == sizeof(BakeJob))
+			{
+				auto& job = *reinterpret_cast<BakeJob const*>(payload.data());
+				if (!bakePrepared)
+				{
+					bakeSource = prepare_vertex_bake(scene);
+					bakePrepared = true;
+				}
+				size_t count = size_t(job.end - job.begin);
+				result.resize(4 * count);
+				auto dest = reinterpret_cast<vec4*>(result.data());
+				stdx::parallel_for(count, 64, [&](size_t begin, size_t end)
+				{
+					bake_vertices(scene, bvh, bakeSource, job.params, size_t(job.begin) + begin, size_t(job.begin) + end, dest + begin);
+				}, init.threads);
+			}
+			else
+				throwx( farm_error("unexpected farm message") );
+
+			if (!send_message(socket, message_type::result, header.job, result.data(), sizeof(float) * result.size()))
+				break;
+			++served;
+		}
+		return served;
+	}
+
+} // namespace
+
+void save_shared_scene(char const* path, Scene const& scene)
+{
+	// all other chunks hold multiples of 4 bytes, pad a copy of the path pool only
+	std::vector<char> texturePaths(scene.texturePaths.begin(), scene.texturePaths.end());
+	while (texturePaths.size() % 4 != 0)
+		texturePaths.push_back(0);
+
+	auto view = make_scene_view(scene);
+	view.texturePaths = stdx::make_range_n(static_cast<char const*>(texturePaths.data()), texturePaths.size());
+
+	auto size = compute_size(view, true);
+	stdx::mapped_file file(path, size, stdx::file_flags::readwrite, stdx::file_flags::new_overwrite);
+	write(file.data, view, true);
+}
+
+FarmCoordinator::FarmCoordinator(char const* scenePath, char const* socketPath)
+	: file(scenePath, 0, stdx::file_flags::read, stdx::file_flags::existing, stdx::file_flags::read, stdx::file_flags::random)
+	, scenePath(scenePath)
+	, socketPath(socketPath)
+	, listener(-1)
+	, jobsInFlight(2)
+	, acceptTimeout(60000)
+	, verified(false)
+{
+	// checksums are verified on first use, parallel verification would start pool threads before spawnWorkers() forks
+	scene = map_scene(file.crange(), io_error_handlers::exception, read_mode::trusted);
+
+	auto address = make_address(socketPath);
+	::unlink(socketPath);
+	listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener == -1
+		|| ::bind(listener, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0
+		|| ::listen(listener, 64) != 0)
+	{
+		if (listener != -1)
+			::close(listener);
+		throwx( farm_error(socketPath) );
+	}
+}
+
+FarmCoordinator::~FarmCoordinator()
+{
+	for (auto& w : workers)
+	{
+		send_message(w.socket, message_type::quit, 0);
+		::close(w.socket);
+	}
+	::close(listener);
+	::unlink(socketPath.c_str());
+
+	// forked workers exit once their connection closes
+	for (auto pid : processes)
+		::waitpid(pid, nullptr, 0);
+}
+
+bool FarmCoordinator::acceptWorker(unsigned threads, int timeout)
+{
+	pollfd poll = { listener, POLLIN, 0 };
+	int ready;
+	while ((ready = ::poll(&poll, 1, timeout)) == -1 && errno == EINTR);
+	if (ready == -1)
+		throwx( farm_error("failed to poll for workers") );
+	if (ready == 0)
+		return false;
+
+	int socket;
+	while ((socket = ::accept(listener, nullptr, nullptr)) == -1 && errno == EINTR);
+	if (socket == -1)
+		throwx( farm_error("failed to accept worker") );
+
+	InitJob init = { threads };
+	if (!send_message(socket, message_type::init, 0, &init, sizeof(init), scenePath.data(), scenePath.size()))
+	{
+		::close(socket);
+		throwx( farm_error("failed to initialize worker") );
+	}
+
+	Worker worker;
+	worker.socket = socket;
+	workers.push_back(std::move(worker));
+	return true;
+}
+
+void FarmCoordinator::acceptWorkers(unsigned count, unsigned threadsPerWorker)
+{
+	acceptWorkers(count, threadsPerWorker, nullptr);
+}
+
+void FarmCoordinator::acceptWorkers(unsigned count, unsigned threadsPerWorker, std::vector<int>* spawned)
+{
+	if (threadsPerWorker == 0)
+		threadsPerWorker = stdx::max_value(stdx::hardware_threads() / stdx::max_value(count, 1U), 1U);
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(acceptTimeout);
+	while (count > 0)
+	{
+		auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		if (remaining <= 0)
+			throwx( farm_error("timed out waiting for workers") );
+
+		// wake up regularly to notice spawned workers that died before connecting
+		int timeout = int( (spawned) ? stdx::min_value(remaining, decltype(remaining)(100)) : remaining );
+		if (acceptWorker(threadsPerWorker, timeout))
+		{
+			--count;
+			continue;
+		}
+
+		if (spawned)
+			for (size_t i = spawned->size(); i-- > 0; )
+				if (::waitpid((*spawned)[i], nullptr, WNOHANG) == (*spawned)[i])
+				{
+					processes.erase(std::find(processes.begin(), processes.end(), (*spawned)[i]));
+					spawned->erase(spawned->begin() + i);
+					--count;
+				}
+	}
+}
+
+void FarmCoordinator::spawnWorkers(unsigned count, unsigned threadsPerWorker)
+{
+	std::vector<int> spawned;
+	for (unsigned i = 0; i < count; ++i)
+	{
+		auto pid = ::fork();
+		if (pid == -1)
+			throwx( farm_error("failed to fork worker") );
+		if (pid == 0)
+		{
+			// fork w/o exec, drop inherited connections so other workers still see their coordinator hang up
+			::close(listener);
+			for (auto& w : workers)
+				::close(w.socket);
+			int status = 0;
+			try { run_farm_worker(socketPath.c_str()); }
+			catch (...) { status = 1; }
+			::_exit(status);
+		}
+		processes.push_back(int(pid));
+		spawned.push_back(int(pid));
+	}
+	acceptWorkers(count, threadsPerWorker, &spawned);
+}
+
+template <class Job, class Integrate>
+void FarmCoordinator::run(unsigned type, std::vector<Job> const& jobs, Integrate&& integrate)
+{
+	if (!verified)
+	{
+		verify_checksums(file.crange(), io_error_handlers::exception);
+		verified = true;
+	}
+
+	std::deque<size_t> pending;
+	for (size_t i = 0; i < jobs.size(); ++i)
+		pending.push_back(i);
+	size_t remaining = jobs.size();
+
+	auto&& lose = [&](size_t w)
+	{
+		// reassign the lost worker's jobs
+		for (auto j : workers[w].jobs)
+			pending.push_front(j);
+		::close(workers[w].socket);
+		workers.erase(workers.begin() + w);
+	};
+
+	std::vector<pollfd> polls;
+	std::vector<char> payload;
+	while (remaining > 0)
+	{
+		for (size_t w = 0; w < workers.size(); )
+		{
+			bool alive = true;
+			while (alive && workers[w].jobs.size() < jobsInFlight && !pending.empty())
+			{
+				auto j = pending.front();
+				alive = send_message(workers[w].socket, message_type::t(type), j, &jobs[j], sizeof(Job));
+				if (alive)
+				{
+					pending.pop_front();
+					workers[w].jobs.push_back(j);
+				}
+			}
+			if (alive) ++w;
+			else lose(w);
+		}
+		if (workers.empty())
+			throwx( farm_error("no farm workers left") );
+
+		polls.resize(workers.size());
+		for (size_t w = 0; w < workers.size(); ++w)
+		{
+			polls[w].fd = workers[w].socket;
+			polls[w].events = POLLIN;
+			polls[w].revents = 0;
+		}
+		if (::poll(polls.data(), polls.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throwx( farm_error("failed to poll workers") );
+		}
+
+		for (size_t w = polls.size(); w-- > 0; )
+		{
+			if (!polls[w].revents)
+				continue;
+
+			MessageHeader header;
+			auto& inFlight = workers[w].jobs;
+			auto it = inFlight.end();
+			if (recv_message(workers[w].socket, header, payload) && header.type == message_type::result)
+				it = std::find(inFlight.begin(), inFlight.end(), size_t(header.job));
+			if (it == inFlight.end())
+			{
+				lose(w);
+				continue;
+			}
+
+			inFlight.erase(it);
+			integrate(jobs[size_t(header.job)], reinterpret_cast<float const*>(payload.data()), payload.size() / sizeof(float));
+			--remaining;
+		}
+	}
+}
+
+void FarmCoordinator::render(math::mat4 const& viewProjInverse, TraceAccumulator& accum, unsigned passes, TraceParams const& params)
+{
+	auto res = accum.resolution();
+	unsigned tileSize = math::max(params.tileSize, 1U);
+
+	std::vector<TraceJob> jobs;
+	for (unsigned y = 0; y < res.y; y += tileSize)
+		for (unsigned x = 0; x < res.x; x += tileSize)
+		{
+			TraceJob job;
+			job.viewProjInverse = viewProjInverse;
+			job.resolution = res;
+			job.begin = glm::uvec2(x, y);
+			job.end = min(job.begin + tileSize, res);
+			job.firstPass = accum.passes;
+			job.passes = passes;
+			job.params = params;
+			jobs.push_back(job);
+		}
+
+	run(message_type::trace, jobs, [&](TraceJob const& job, float const* sums, size_t count)
+	{
+		auto dim = job.end - job.begin;
+		if (count != 4 * size_t(dim.x) * dim.y)
+			throwx( farm_error("invalid tile result") );
+		for (unsigned y = 0; y < dim.y; ++y)
+		{
+			float* dest = &accum.sums.pixels[4 * ((size_t(job.begin.y) + y) * res.x + job.begin.x)];
+			float const* src = sums + 4 * size_t(y) * dim.x;
+			for (unsigned i = 0; i < 4 * dim.x; ++i)
+				dest[i] += src[i];
+		}
+	});
+	accum.passes += passes;
+}
+
+std::vector<vec4> FarmCoordinator::bakeVertices(BakeParams const& params, size_t chunkSize)
+{
+	size_t count = scene.positions.size();
+	chunkSize = stdx::max_value(chunkSize, size_t(1));
+
+	std::vector<BakeJob> jobs;
+	for (size_t begin = 0; begin < count; begin += chunkSize)
+	{
+		BakeJob job;
+		job.begin = begin;
+		job.end = stdx::min_value(begin + chunkSize, count);
+		job.params = params;
+		jobs.push_back(job);
+	}
+
+	std::vector<vec4> lighting(count);
+	run(message_type::bake, jobs, [&](BakeJob const& job, float const* values, size_t valueCount)
+	{
+		if (valueCount != 4 * size_t(job.end - job.begin))
+			throwx( farm_error("invalid bake result") );
+		memcpy(&lighting[size_t(job.begin)], values, sizeof(float) * valueCount);
+	});
+	return lighting;
+}
+
+unsigned run_farm_worker(char const* socketPath)
+{
+	auto address = make_address(socketPath);
+	int socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socket == -1 || ::connect(socket, reinterpret_cast<sockaddr const*>(&address), sizeof(address)) != 0)
+	{
+		if (socket != -1)
+			::close(socket);
+		throwx( farm_error(socketPath) );
+	}
+
+	unsigned served;
+	try
+	{
+		served = serve_jobs(socket);
+	}
+	catch (...)
+	{
+		::close(socket);
+		throw;
+	}
+	::close(socket);
+	return served;
+}
+
+} // namespace
@@ -0,0 +1,554 @@
+#include "scenelights"
+#include "scenebounds"
+#include "parallel"
+
+#include <algorithm>
+#include <cfloat>
+
+namespace scene
+{
+
+namespace
+{
+	typedef math::vec<float, 3> vec3;
+	typedef math::aabb<vec3> box3;
+
+	float const pi = 3.14159265f;
+	unsigned const bin_count = 12;
+
+	float luminance(vec3 const& c)
+	{
+		return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+
+	box3 make_box(vec3 const& min, vec3 const& max)
+	{
+		box3 box = { min, max };
+		return box;
+	}
+
+	float half_area(box3 const& box)
+	{
+		if (is_empty(box))
+			return 0.0f;
+		vec3 e = box.max - box.min;
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+
+	// cone of lines (two-sided normals) around +/-axis
+	struct Cone
+	{
+		vec3 axis;
+		float cosSpread;
+		bool empty;
+	};
+
+	Cone empty_cone()
+	{
+		Cone c = { vec3(0.0f, 0.0f, 1.0f), 1.0f, true };
+		return c;
+	}
+
+	Cone union_cones(Cone a, Cone b)
+	{
+		if (a.empty) return b;
+		if (b.empty) return a;
+
+		if (dot(a.axis, b.axis) < 0.0f)
+			b.axis = -b.axis;
+		float thetaA = acos(math::clamp(a.cosSpread, -1.0f, 1.0f));
+		float thetaB = acos(math::clamp(b.cosSpread, -1.0f, 1.0f));
+		float thetaD = acos(math::clamp(dot(a.axis, b.axis), -1.0f, 1.0f));
+		if (thetaD + thetaB <= thetaA) return a;
+		if (thetaD + thetaA <= thetaB) return b;
+
+		// lines are covered entirely beyond a right angle
+		float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+		Cone c = { a.axis, 0.0f, false };
+		if (thetaO >= 0.5f * pi || !(sin(thetaD) > 1.0e-6f))
+			return c;
+
+		// rotate towards b, in the plane spanned by both axes
+		float thetaR = thetaO - thetaA;
+		c.axis = normalize(sin(thetaD - thetaR) * a.axis + sin(thetaR) * b.axis);
+		c.cosSpread = cos(thetaO);
+		return c;
+	}
+
+	// orientation measure of a cone of emitters w/ hemispherical emission (Conty & Kulla 2018)
+	float cone_measure(Cone const& c)
+	{
+		float thetaO = acos(math::clamp(c.cosSpread, -1.0f, 1.0f));
+		float thetaW = math::min(thetaO + 0.5f * pi, pi);
+		float sinO = sin(thetaO);
+		return 2.0f * pi * (1.0f - c.cosSpread)
+			+ 0.5f * pi * (2.0f * thetaW * sinO - cos(thetaO - 2.0f * thetaW) - 2.0f * thetaO * sinO + c.cosSpread);
+	}
+
+	// cos(max(0, a - b)) & sin(max(0, a - b)) from sines & cosines
+	float cos_sub_clamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		return (cosA > cosB) ? 1.0f : cosA * cosB + sinA * sinB;
+	}
+	float sin_sub_clamped(float sinA, float cosA, float sinB, float cosB)
+	{
+		return (cosA > cosB) ? 0.0f : sinA * cosB - cosA * sinB;
+	}
+
+	// conservative estimate of the light arriving at the given point from the given node
+	float importance(LightNode const& node, vec3 const& p, vec3 const& n)
+	{
+		vec3 center = 0.5f * (node.bounds.min + node.bounds.max);
+		vec3 d = p - center;
+		float d2 = dot(d, d);
+		float r2 = 0.25f * dot(node.bounds.max - node.bounds.min, node.bounds.max - node.bounds.min);
+		float dist2 = math::max(d2, r2);
+		if (!(dist2 > 0.0f))
+			return node.power;
+		if (d2 <= r2)
+			return node.power / dist2;
+
+		// directions towards the bounds
+		float sin2B = r2 / d2;
+		float sinB = sqrt(sin2B), cosB = sqrt(1.0f - sin2B);
+
+		// emitter orientation, two-sided
+		vec3 w = d / sqrt(d2);
+		float cosW = math::min(fabs(dot(node.axis, w)), 1.0f);
+		float sinW = sqrt(1.0f - cosW * cosW);
+		float cosO = node.cosSpread, sinO = sqrt(math::max(0.0f, 1.0f - cosO * cosO));
+		float cosX = cos_sub_clamped(sinW, cosW, sinO, cosO), sinX = sin_sub_clamped(sinW, cosW, sinO, cosO);
+		float cosP = cos_sub_clamped(sinX, cosX, sinB, cosB);
+		if (cosP <= 0.0f)
+			return 0.0f;
+
+		float result = node.power * cosP / dist2;
+
+		// receiver orientation
+		if (dot(n, n) > 0.0f)
+		{
+			float cosI = math::clamp(-dot(w, n), -1.0f, 1.0f);
+			float sinI = sqrt(1.0f - cosI * cosI);
+			float cosIP = cos_sub_clamped(sinI, cosI, sinB, cosB);
+			if (cosIP <= 0.0f)
+				return 0.0f;
+			result *= cosIP;
+		}
+
+		return result;
+	}
+
+	struct BuildTask
+	{
+		unsigned node;
+		unsigned begin, end;
+	};
+
+	struct Builder
+	{
+		std::vector<box3> const& bounds;
+		std::vector<vec3> const& centroids;
+		std::vector<Cone> const& cones;
+		std::vector<float> const& powers;
+		std::vector<unsigned>& order;
+
+		Builder(std::vector<box3> const& bounds, std::vector<vec3> const& centroids, std::vector<Cone> const& cones
+			, std::vector<float> const& powers, std::vector<unsigned>& order)
+			: bounds(bounds)
+			, centroids(centroids)
+			, cones(cones)
+			, powers(powers)
+			, order(order) { }
+
+		// binned SAOH over centroids
+		unsigned split(unsigned begin, unsigned end)
+		{
+			box3 centroidBounds = empty_bounds();
+			for (unsigned i = begin; i < end; ++i)
+				centroidBounds = union_bounds(centroidBounds, make_box(centroids[order[i]], centroids[order[i]]));
+
+			float bestCost = FLT_MAX;
+			int bestAxis = -1;
+			unsigned bestBin = 0;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				float lo = centroidBounds.min[axis], extent = centroidBounds.max[axis] - lo;
+				if (!(extent > 0.0f))
+					continue;
+				float scale = float(bin_count) / extent;
+
+				box3 binBounds[bin_count];
+				Cone binCones[bin_count];
+				float binPowers[bin_count] = { 0.0f };
+				unsigned binCounts[bin_count] = { 0 };
+				for (unsigned b = 0; b < bin_count; ++b)
+				{
+					binBounds[b] = empty_bounds();
+					binCones[b] = empty_cone();
+				}
+				for (unsigned i = begin; i < end; ++i)
+				{
+					auto t = order[i];
+					unsigned bin = math::min(unsigned((centroids[t][axis] - lo) * scale), bin_count - 1);
+					binBounds[bin] = union_bounds(binBounds[bin], bounds[t]);
+					binCones[bin] = union_cones(binCones[bin], cones[t]);
+					binPowers[bin] += powers[t];
+					++binCounts[bin];
+				}
+
+				// right-to-left sweep, then evaluate left-to-right
+				float rightCosts[bin_count];
+				unsigned rightCounts[bin_count];
+				box3 accBounds = empty_bounds();
+				Cone accCone = empty_cone();
+				float accPower = 0.0f;
+				unsigned accCount = 0;
+				for (unsigned b = bin_count; b-- > 1; )
+				{
+					accBounds = union_bounds(accBounds, binBounds[b]);
+					accCone = union_cones(accCone, binCones[b]);
+					accPower += binPowers[b];
+					accCount += binCounts[b];
+					rightCosts[b] = accPower * half_area(accBounds) * cone_measure(accCone);
+					rightCounts[b] = accCount;
+				}
+				accBounds = empty_bounds();
+				accCone = empty_cone();
+				accPower = 0.0f;
+				accCount = 0;
+				for (unsigned b = 1; b < bin_count; ++b)
+				{
+					accBounds = union_bounds(accBounds, binBounds[b - 1]);
+					accCone = union_cones(accCone, binCones[b - 1]);
+					accPower += binPowers[b - 1];
+					accCount += binCounts[b - 1];
+					float cost = accPower * half_area(accBounds) * cone_measure(accCone) + rightCosts[b];
+					if (accCount && rightCounts[b] && cost < bestCost)
+					{
+						bestCost = cost;
+						bestAxis = axis;
+						bestBin = b;
+					}
+				}
+			}
+
+			// coincident centroids, fall back to an object median split
+			if (bestAxis < 0)
+				return begin + (end - begin) / 2;
+
+			float lo = centroidBounds.min[bestAxis];
+			float scale = float(bin_count) / (centroidBounds.max[bestAxis] - lo);
+			auto it = std::partition(order.begin() + begin, order.begin() + end, [&](unsigned t)
+			{
+				return math::min(unsigned((centroids[t][bestAxis] - lo) * scale), bin_count - 1) < bestBin;
+			});
+			return unsigned(it - order.begin());
+		}
+
+		// builds the subtree of the given (allocated) node, hands large ranges to tasks if given
+		void build(std::vector<LightNode>& nodes, unsigned nodeIdx, unsigned begin, unsigned end, std::vector<BuildTask>* tasks, unsigned taskSize)
+		{
+			auto& node = nodes[nodeIdx];
+			Cone cone = empty_cone();
+			node.bounds = empty_bounds();
+			node.power = 0.0f;
+			for (unsigned i = begin; i < end; ++i)
+			{
+				auto t = order[i];
+				node.bounds = union_bounds(node.bounds, bounds[t]);
+				cone = union_cones(cone, cones[t]);
+				node.power += powers[t];
+			}
+			node.axis = cone.axis;
+			node.cosSpread = cone.cosSpread;
+			node.parent = ~0U;
+
+			if (end - begin == 1)
+			{
+				node.first = begin;
+				node.count = 1;
+				return;
+			}
+			if (tasks && end - begin <= taskSize)
+			{
+				BuildTask task = { nodeIdx, begin, end };
+				tasks->push_back(task);
+				return;
+			}
+
+			unsigned mid = split(begin, end);
+			unsigned left = unsigned(nodes.size());
+			nodes.resize(nodes.size() + 2);
+			nodes[nodeIdx].first = left;
+			nodes[nodeIdx].count = 0;
+			build(nodes, left, begin, mid, tasks, taskSize);
+			build(nodes, left + 1, mid, end, tasks, taskSize);
+		}
+	};
+
+	template <class Scene>
+	float child_probability(Scene const& scene, LightNode const& parent, unsigned child, vec3 const& p, vec3 const& n)
+	{
+		float left = importance(scene.lightNodes[parent.first], p, n);
+		float right = importance(scene.lightNodes[parent.first + 1], p, n);
+		float sum = left + right;
+		if (!(sum > 0.0f))
+			return 0.0f;
+		return ((child == parent.first) ? left : right) / sum;
+	}
+
+	template <class Triangle>
+	float triangle_area(Triangle const& tri)
+	{
+		return 0.5f * length(cross(tri.e1, tri.e2));
+	}
+
+} // namespace
+
+void build_light_bvh(Scene& scene)
+{
+	scene.lightNodes.clear();
+	scene.lightTriangles.clear();
+
+	auto&& emission = [&](Instance const& inst) -> vec3
+	{
+		unsigned material = scene.meshes[inst.mesh].material;
+		return (material < scene.materials.size()) ? vec3(scene.materials[material].emissive) : vec3(0.0f);
+	};
+
+	// emissive triangles of all instances
+	std::vector<size_t> firstTriangles(scene.instances.size() + 1);
+	for (size_t i = 0; i < scene.instances.size(); ++i)
+	{
+		auto prims = scene.meshes[scene.instances[i].mesh].primitives;
+		size_t count = (luminance(emission(scene.instances[i])) > 0.0f) ? (prims.last - prims.first) / 3 : 0;
+		firstTriangles[i + 1] = firstTriangles[i] + count;
+	}
+	size_t triangleCount = firstTriangles.back();
+	if (!triangleCount)
+		return;
+
+	std::vector<LightTriangle> triangles(triangleCount);
+	std::vector<box3> bounds(triangleCount);
+	std::vector<vec3> centroids(triangleCount);
+	std::vector<Cone> cones(triangleCount);
+	std::vector<float> powers(triangleCount);
+	stdx::parallel_for(scene.instances.size(), 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			if (firstTriangles[i] == firstTriangles[i + 1])
+				continue;
+
+			auto& inst = scene.instances[i];
+			auto prims = scene.meshes[inst.mesh].primitives;
+			vec3 emitted = emission(inst);
+			size_t t = firstTriangles[i];
+			for (unsigned p = prims.first; p + 3 <= prims.last; p += 3, ++t)
+			{
+				vec3 v0 = inst.transform * math::vec<float, 4>(scene.positions[scene.indices[p]], 1.0f);
+				vec3 v1 = inst.transform * math::vec<float, 4>(scene.positions[scene.indices[p + 1]], 1.0f);
+				vec3 v2 = inst.transform * math::vec<float, 4>(scene.positions[scene.indices[p + 2]], 1.0f);
+
+				auto& tri = triangles[t];
+				tri.v0 = v0;
+				tri.e1 = v1 - v0;
+				tri.e2 = v2 - v0;
+				tri.emission = emitted;
+				tri.instance = unsigned(i);
+				tri.primitive = p;
+				tri.node = ~0U;
+
+				vec3 normal = cross(tri.e1, tri.e2);
+				float len = length(normal);
+				Cone cone = { (len > 0.0f) ? normal / len : vec3(0.0f, 0.0f, 1.0f), 1.0f, false };
+				cones[t] = cone;
+				powers[t] = luminance(emitted) * 0.5f * len;
+
+				bounds[t] = make_box(min(v0, min(v1, v2)), max(v0, max(v1, v2)));
+				centroids[t] = (v0 + v1 + v2) / 3.0f;
+			}
+		}
+	});
+
+	// degenerate triangles emit nothing
+	std::vector<unsigned> order;
+	order.reserve(triangleCount);
+	for (unsigned i = 0; i < unsigned(triangleCount); ++i)
+		if (powers[i] > 0.0f)
+			order.push_back(i);
+	if (order.empty())
+		return;
+	unsigned lightCount = unsigned(order.size());
+
+	// top levels sequentially, then independent subtrees in parallel
+	Builder builder(bounds, centroids, cones, powers, order);
+	std::vector<BuildTask> tasks;
+	unsigned taskSize = math::max(lightCount / (8 * stdx::hardware_threads()), 1024U);
+	std::vector<LightNode> nodes(1);
+	builder.build(nodes, 0, 0, lightCount, &tasks, taskSize);
+
+	std::vector< std::vector<LightNode> > subtrees(tasks.size());
+	stdx::parallel_for(tasks.size(), 1, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+		{
+			subtrees[i].resize(1);
+			builder.build(subtrees[i], 0, tasks[i].begin, tasks[i].end, nullptr, 0);
+		}
+	});
+
+	// splice subtrees, local node k > 0 moves to base + k - 1
+	for (size_t i = 0; i < tasks.size(); ++i)
+	{
+		auto& subtree = subtrees[i];
+		unsigned base = unsigned(nodes.size());
+		for (auto& node : subtree)
+			if (!node.count)
+				node.first += base - 1;
+		nodes[tasks[i].node] = subtree[0];
+		nodes.insert(nodes.end(), subtree.begin() + 1, subtree.end());
+	}
+
+	// link parents & leaves
+	scene.lightTriangles.resize(lightCount);
+	for (unsigned i = 0, ie = unsigned(nodes.size()); i < ie; ++i)
+	{
+		auto& node = nodes[i];
+		if (node.count)
+		{
+			scene.lightTriangles[node.first] = triangles[order[node.first]];
+			scene.lightTriangles[node.first].node = i;
+		}
+		else
+		{
+			nodes[node.first].parent = i;
+			nodes[node.first + 1].parent = i;
+		}
+	}
+	nodes[0].parent = ~0U;
+
+	scene.lightNodes = std::move(nodes);
+}
+
+template <class Scene>
+bool sample_light(Scene const& scene, vec3 const& position, vec3 const& normal, float u1, float u2, float u3, LightSample& sample)
+{
+	if (scene.lightNodes.empty() || !(importance(scene.lightNodes[0], position, normal) > 0.0f))
+		return false;
+
+	// descend by importance, reusing the selection variable
+	float pmf = 1.0f;
+	unsigned nodeIdx = 0;
+	while (!scene.lightNodes[nodeIdx].count)
+	{
+		auto& node = scene.lightNodes[nodeIdx];
+		float pLeft = child_probability(scene, node, node.first, position, normal);
+		if (u3 < pLeft)
+		{
+			nodeIdx = node.first;
+			pmf *= pLeft;
+			u3 /= pLeft;
+		}
+		else
+		{
+			float pRight = 1.0f - pLeft;
+			if (!(pRight > 0.0f))
+				return false;
+			nodeIdx = node.first + 1;
+			pmf *= pRight;
+			u3 = (u3 - pLeft) / pRight;
+		}
+		u3 = math::min(u3, 0.99999994f);
+	}
+
+	// uniform point on the triangle
+	unsigned light = scene.lightNodes[nodeIdx].first;
+	auto& tri = scene.lightTriangles[light];
+	float su = sqrt(u1);
+	sample.position = tri.v0 + (su * (1.0f - u2)) * tri.e1 + (su * u2) * tri.e2;
+
+	vec3 toLight = sample.position - position;
+	float dist2 = dot(toLight, toLight);
+	vec3 n = normalize(cross(tri.e1, tri.e2));
+	float cosLight = (dist2 > 0.0f) ? dot(n, toLight) / sqrt(dist2) : 0.0f;
+	if (cosLight == 0.0f)
+		return false;
+
+	sample.normal = (cosLight > 0.0f) ? -n : n;
+	sample.emission = tri.emission;
+	sample.pdf = pmf * dist2 / (triangle_area(tri) * fabs(cosLight));
+	sample.light = light;
+	return true;
+}
+
+template <class Scene>
+float light_pmf(Scene const& scene, vec3 const& position, vec3 const& normal, unsigned light)
+{
+	if (light >= scene.lightTriangles.size() || !(importance(scene.lightNodes[0], position, normal) > 0.0f))
+		return 0.0f;
+
+	float pmf = 1.0f;
+	for (unsigned nodeIdx = scene.lightTriangles[light].node; scene.lightNodes[nodeIdx].parent != ~0U; )
+	{
+		auto parentIdx = scene.lightNodes[nodeIdx].parent;
+		pmf *= child_probability(scene, scene.lightNodes[parentIdx], nodeIdx, position, normal);
+		nodeIdx = parentIdx;
+	}
+	return pmf;
+}
+
+template <class Scene>
+float light_pdf(Scene const& scene, vec3 const& position, vec3 const& normal, unsigned light, vec3 const& lightPosition)
+{
+	float pmf = light_pmf(scene, position, normal, light);
+	if (!(pmf > 0.0f))
+		return 0.0f;
+
+	auto& tri = scene.lightTriangles[light];
+	vec3 toLight = lightPosition - position;
+	float dist2 = dot(toLight, toLight);
+	float cosLight = (dist2 > 0.0f) ? fabs(dot(normalize(cross(tri.e1, tri.e2)), toLight)) / sqrt(dist2) : 0.0f;
+	return (cosLight > 0.0f) ? pmf * dist2 / (triangle_area(tri) * cosLight) : 0.0f;
+}
+
+template <class Scene>
+vec3 sample_direct_light(Scene const& scene, TriangleBvh const& bvh, vec3 const& position, vec3 const& normal, float rayOffset, SampleRandom& random)
+{
+	if (scene.lightNodes.empty())
+		return vec3(0.0f);
+
+	LightSample sample;
+	float u1 = random.uniform(), u2 = random.uniform(), u3 = random.uniform();
+	if (!sample_light(scene, position, normal, u1, u2, u3, sample))
+		return vec3(0.0f);
+
+	vec3 toLight = sample.position - position;
+	float dist = length(toLight);
+	vec3 dir = toLight / dist;
+	float cosReceiver = dot(normal, dir);
+	if (cosReceiver <= 0.0f)
+		return vec3(0.0f);
+
+	// stop short of the light itself
+	math::ray<vec3> shadow;
+	shadow.o = position + rayOffset * normal;
+	shadow.d = dir;
+	if (bvh.occluded(shadow, dist * (1.0f - 1.0e-3f) - rayOffset))
+		return vec3(0.0f);
+
+	return sample.emission * (cosReceiver / (pi * sample.pdf));
+}
+
+#define SCENE_LIGHTS_INSTANTIATE(Scene) \
+	template bool sample_light(Scene const& scene, vec3 const& position, vec3 const& normal, float u1, float u2, float u3, LightSample& sample); \
+	template float light_pmf(Scene const& scene, vec3 const& position, vec3 const& normal, unsigned light); \
+	template float light_pdf(Scene const& scene, vec3 const& position, vec3 const& normal, unsigned light, vec3 const& lightPosition); \
+	template vec3 sample_direct_light(Scene const& scene, TriangleBvh const& bvh, vec3 const& position, vec3 const& normal, float rayOffset, SampleRandom& random);
+
+SCENE_LIGHTS_INSTANTIATE(Scene)
+SCENE_LIGHTS_INSTANTIATE(ExternalScene)
+
+#undef SCENE_LIGHTS_INSTANTIATE
+
+} // namespace
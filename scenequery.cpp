@@ -0,0 +1,345 @@
+#include "scenequery"
+
+#include <cfloat>
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+	#define SCENE_QUERY_SSE
+	#include <xmmintrin.h>
+#endif
+
+namespace scene
+{
+
+namespace
+{
+	typedef math::vec<float, 3> vec3;
+	typedef math::aabb<vec3> box3;
+
+	unsigned const closest_point_grain = 256; // points per parallel work item
+
+#ifdef SCENE_QUERY_SSE
+	inline __m128 load_vec3(float const* p)
+	{
+		return _mm_movelh_ps(_mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<__m64 const*>(p)), _mm_load_ss(p + 2));
+	}
+
+	inline __m128 box_offset(box3 const& box, __m128 p)
+	{
+		// per-axis distance outside the box, zero inside
+		__m128 zero = _mm_setzero_ps();
+		return _mm_max_ps(_mm_max_ps(_mm_sub_ps(load_vec3(&box.min.x), p), _mm_sub_ps(p, load_vec3(&box.max.x))), zero);
+	}
+
+	// squared distances from the given point to both children of an inner node at once
+	inline void child_distances(BvhNode const* children, vec3 const& point, float& left, float& right)
+	{
+		__m128 p = load_vec3(&point.x);
+		__m128 dl = box_offset(children[0].bounds, p);
+		__m128 dr = box_offset(children[1].bounds, p);
+		dl = _mm_mul_ps(dl, dl);
+		dr = _mm_mul_ps(dr, dr);
+		// transpose to horizontally add the (x, y, z, 0) lanes of both
+		__m128 lo = _mm_unpacklo_ps(dl, dr); // xl xr yl yr
+		__m128 hi = _mm_unpackhi_ps(dl, dr); // zl zr 0 0
+		__m128 sum = _mm_add_ps(_mm_add_ps(lo, _mm_movehl_ps(lo, lo)), hi);
+		float r[4];
+		_mm_storeu_ps(r, sum);
+		left = r[0];
+		right = r[1];
+	}
+
+	inline bool boxes_overlap(box3 const& a, box3 const& b)
+	{
+		__m128 lo = _mm_cmpgt_ps(load_vec3(&a.min.x), load_vec3(&b.max.x));
+		__m128 hi = _mm_cmpgt_ps(load_vec3(&b.min.x), load_vec3(&a.max.x));
+		return (_mm_movemask_ps(_mm_or_ps(lo, hi)) & 0x7) == 0;
+	}
+#else
+	inline float box_distance_sq(box3 const& box, vec3 const& p)
+	{
+		vec3 d = max(max(box.min - p, p - box.max), vec3(0.0f));
+		return dot(d, d);
+	}
+
+	inline void child_distances(BvhNode const* children, vec3 const& point, float& left, float& right)
+	{
+		left = box_distance_sq(children[0].bounds, point);
+		right = box_distance_sq(children[1].bounds, point);
+	}
+
+	inline bool boxes_overlap(box3 const& a, box3 const& b)
+	{
+		return a.min.x <= b.max.x && a.min.y <= b.max.y && a.min.z <= b.max.z
+			&& b.min.x <= a.max.x && b.min.y <= a.max.y && b.min.z <= a.max.z;
+	}
+#endif
+
+	// separating axis test of a triangle against a box given by center & half extents (Akenine-Moeller)
+	bool triangle_overlaps_box(BvhTriangle const& tri, vec3 const& center, vec3 const& halfSize)
+	{
+		vec3 v[3] = { tri.v0 - center, tri.v0 + tri.e1 - center, tri.v0 + tri.e2 - center };
+		vec3 edges[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+
+		// box face normals
+		for (int a = 0; a < 3; ++a)
+		{
+			float lo = math::min(v[0][a], math::min(v[1][a], v[2][a]));
+			float hi = math::max(v[0][a], math::max(v[1][a], v[2][a]));
+			if (lo > halfSize[a] || hi < -halfSize[a])
+				return false;
+		}
+
+		// triangle plane
+		vec3 n = cross(tri.e1, tri.e2);
+		if (math::abs(dot(n, v[0])) > dot(abs(n), halfSize))
+			return false;
+
+		// cross products of box axes & triangle edges
+		for (int e = 0; e < 3; ++e)
+			for (int a = 0; a < 3; ++a)
+			{
+				vec3 axis(0.0f);
+				axis[(a + 1) % 3] = -edges[e][(a + 2) % 3];
+				axis[(a + 2) % 3] = edges[e][(a + 1) % 3];
+				float p0 = dot(axis, v[0]), p1 = dot(axis, v[1]), p2 = dot(axis, v[2]);
+				float r = dot(abs(axis), halfSize);
+				if (math::min(p0, math::min(p1, p2)) > r || math::max(p0, math::max(p1, p2)) < -r)
+					return false;
+			}
+
+		return true;
+	}
+
+	// visits all leaf triangles whose node bounds pass the given test
+	template <class NodeTest, class TriangleFun>
+	void for_each_overlapping(TriangleBvh const& bvh, NodeTest&& nodeTest, TriangleFun&& fun)
+	{
+		if (bvh.nodes.empty() || !nodeTest(bvh.nodes[0].bounds))
+			return;
+
+		unsigned stack[bvh_max_depth];
+		unsigned stackSize = 0;
+		unsigned nodeIdx = 0;
+
+		while (true)
+		{
+			auto& node = bvh.nodes[nodeIdx];
+			if (node.count)
+			{
+				for (unsigned i = node.first, ie = node.first + node.count; i < ie; ++i)
+					fun(i);
+			}
+			else
+			{
+				bool left = nodeTest(bvh.nodes[node.first].bounds);
+				bool right = nodeTest(bvh.nodes[node.first + 1].bounds);
+				if (left && right)
+				{
+					assert (stackSize < arraylen(stack));
+					stack[stackSize++] = node.first + 1;
+					nodeIdx = node.first;
+					continue;
+				}
+				else if (left || right)
+				{
+					nodeIdx = (left) ? node.first : node.first + 1;
+					continue;
+				}
+			}
+
+			if (!stackSize)
+				break;
+			nodeIdx = stack[--stackSize];
+		}
+	}
+
+} // namespace
+
+vec3 closest_point_on_triangle(BvhTriangle const& tri, vec3 const& point, float& u, float& v)
+{
+	// Voronoi regions of vertices, edges & face (Ericson, Real-Time Collision Detection 5.1.5)
+	vec3 const& a = tri.v0;
+	vec3 const& ab = tri.e1;
+	vec3 const& ac = tri.e2;
+	vec3 ap = point - a;
+	float d1 = dot(ab, ap), d2 = dot(ac, ap);
+	if (d1 <= 0.0f && d2 <= 0.0f)
+	{
+		u = v = 0.0f;
+		return a;
+	}
+
+	vec3 bp = ap - ab;
+	float d3 = dot(ab, bp), d4 = dot(ac, bp);
+	if (d3 >= 0.0f && d4 <= d3)
+	{
+		u = 1.0f, v = 0.0f;
+		return a + ab;
+	}
+
+	float vc = d1 * d4 - d3 * d2;
+	if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+	{
+		u = d1 / (d1 - d3), v = 0.0f;
+		return a + u * ab;
+	}
+
+	vec3 cp = ap - ac;
+	float d5 = dot(ab, cp), d6 = dot(ac, cp);
+	if (d6 >= 0.0f && d5 <= d6)
+	{
+		u = 0.0f, v = 1.0f;
+		return a + ac;
+	}
+
+	float vb = d5 * d2 - d1 * d6;
+	if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+	{
+		u = 0.0f, v = d2 / (d2 - d6);
+		return a + v * ac;
+	}
+
+	float va = d3 * d6 - d5 * d4;
+	if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+	{
+		v = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		u = 1.0f - v;
+		return a + ab + v * (ac - ab);
+	}
+
+	float denom = va + vb + vc;
+	if (!(denom > 0.0f))
+	{
+		// degenerate, closest to the first vertex is good enough
+		u = v = 0.0f;
+		return a;
+	}
+	u = vb / denom;
+	v = vc / denom;
+	return a + u * ab + v * ac;
+}
+
+bool closest_point(TriangleBvh const& bvh, vec3 const& point, float maxDist, ClosestPoint& result)
+{
+	result.triangle = ~0U;
+	result.distance = maxDist;
+	if (bvh.nodes.empty())
+		return false;
+
+	float bestSq = maxDist * maxDist;
+	unsigned stack[bvh_max_depth];
+	float stackDist[bvh_max_depth];
+	unsigned stackSize = 0;
+	unsigned nodeIdx = 0;
+
+	while (true)
+	{
+		auto& node = bvh.nodes[nodeIdx];
+		if (node.count)
+		{
+			for (unsigned i = node.first, ie = node.first + node.count; i < ie; ++i)
+			{
+				float u, v;
+				vec3 q = closest_point_on_triangle(bvh.triangles[i], point, u, v);
+				vec3 d = q - point;
+				float distSq = dot(d, d);
+				if (distSq <= bestSq)
+				{
+					bestSq = distSq;
+					result.position = q;
+					result.u = u;
+					result.v = v;
+					result.triangle = i;
+				}
+			}
+		}
+		else
+		{
+			float dLeft, dRight;
+			child_distances(&bvh.nodes[node.first], point, dLeft, dRight);
+			bool left = dLeft <= bestSq, right = dRight <= bestSq;
+			if (left && right)
+			{
+				// nearer child first, the farther one is culled later if the best distance shrinks meanwhile
+				unsigned nearIdx = node.first, farIdx = node.first + 1;
+				float farDist = dRight;
+				if (dRight < dLeft)
+				{
+					std::swap(nearIdx, farIdx);
+					farDist = dLeft;
+				}
+				assert (stackSize < arraylen(stack));
+				stackDist[stackSize] = farDist;
+				stack[stackSize++] = farIdx;
+				nodeIdx = nearIdx;
+				continue;
+			}
+			else if (left || right)
+			{
+				nodeIdx = (left) ? node.first : node.first + 1;
+				continue;
+			}
+		}
+
+		while (stackSize && stackDist[stackSize - 1] > bestSq)
+			--stackSize;
+		if (!stackSize)
+			break;
+		nodeIdx = stack[--stackSize];
+	}
+
+	if (result.triangle == ~0U)
+		return false;
+	result.distance = sqrt(bestSq);
+	return true;
+}
+
+void closest_points(TriangleBvh const& bvh, stdx::data_range_param<vec3 const> points, float maxDist
+	, ClosestPoint* results, unsigned maxThreads)
+{
+	stdx::parallel_for(points.size(), closest_point_grain, [&](size_t begin, size_t end)
+	{
+		for (size_t i = begin; i < end; ++i)
+			closest_point(bvh, points[i], maxDist, results[i]);
+	}, maxThreads);
+}
+
+size_t overlap_sphere(TriangleBvh const& bvh, vec3 const& center, float radius, std::vector<unsigned>& triangles)
+{
+	size_t count = triangles.size();
+	float radiusSq = radius * radius;
+	box3 sphereBox;
+	sphereBox.min = center - vec3(radius);
+	sphereBox.max = center + vec3(radius);
+
+	for_each_overlapping(bvh
+		, [&](box3 const& bounds) { return boxes_overlap(bounds, sphereBox); }
+		, [&](unsigned i)
+		{
+			float u, v;
+			vec3 d = closest_point_on_triangle(bvh.triangles[i], center, u, v) - center;
+			if (dot(d, d) <= radiusSq)
+				triangles.push_back(i);
+		});
+
+	return triangles.size() - count;
+}
+
+size_t overlap_box(TriangleBvh const& bvh, box3 const& box, std::vector<unsigned>& triangles)
+{
+	size_t count = triangles.size();
+	vec3 center = (box.min + box.max) * 0.5f;
+	vec3 halfSize = (box.max - box.min) * 0.5f;
+
+	for_each_overlapping(bvh
+		, [&](box3 const& bounds) { return boxes_overlap(bounds, box); }
+		, [&](unsigned i)
+		{
+			if (triangle_overlaps_box(bvh.triangles[i], center, halfSize))
+				triangles.push_back(i);
+		});
+
+	return triangles.size() - count;
+}
+
+} // namespace
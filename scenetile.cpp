@@ -0,0 +1,164 @@
+#include "scenetile"
+
+namespace scene
+{
+
+TileStreamer::TileStreamer(char const* path, size_t byteBudget, error_handler* errorHandler)
+	: file(path, 0, stdx::file_flags::read, stdx::file_flags::existing, stdx::file_flags::read, stdx::file_flags::random)
+	, byteBudget(byteBudget)
+	, residentBytes(0)
+	, frame(0)
+	, errorHandler(errorHandler)
+	, shutdown(false)
+{
+	read(file.crange(), index, io_error_handlers::exception);
+	tiles.resize(index.tiles.size());
+	for (auto& tile : tiles)
+	{
+		tile.state = Unloaded;
+		tile.lastUse = 0;
+	}
+
+	loader = std::thread(&TileStreamer::loadTiles, this);
+}
+
+TileStreamer::~TileStreamer()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		shutdown = true;
+		requests.clear();
+	}
+	wakeLoader.notify_all();
+	loader.join();
+}
+
+void TileStreamer::loadTiles()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		wakeLoader.wait(lock, [this]() { return shutdown || !requests.empty(); });
+		if (shutdown)
+			break;
+
+		auto tileIdx = requests.front();
+		requests.pop_front();
+		auto desc = index.tiles[tileIdx];
+
+		lock.unlock();
+		CompletedLoad load;
+		load.tileIdx = tileIdx;
+		try
+		{
+			auto tileData = stdx::make_range_n(file.data + desc.offset, (size_t) desc.size);
+			load.scene.reset( new Scene(load_scene(tileData, io_error_handlers::exception)) );
+		}
+		catch (std::exception const& e)
+		{
+			load.error = e.what();
+		}
+		catch (...)
+		{
+			load.error = "unknown error loading tile";
+		}
+		lock.lock();
+
+		completed.push_back( MOVE(load) );
+	}
+}
+
+void TileStreamer::update(math::vec3 viewPos)
+{
+	++frame;
+
+	std::vector<size_t> order(tiles.size());
+	std::vector<float> distances(tiles.size());
+	for (size_t i = 0; i < tiles.size(); ++i)
+	{
+		auto& bounds = index.tiles[i].bounds;
+		distances[i] = length(viewPos - clamp(viewPos, bounds.min, bounds.max));
+		order[i] = i;
+	}
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return distances[a] < distances[b]; });
+
+	std::vector<std::string> failures;
+	std::unique_lock<std::mutex> lock(mutex);
+
+	// integrate finished loads
+	for (auto& c : completed)
+	{
+		auto& tile = tiles[c.tileIdx];
+		if (c.scene)
+		{
+			tile.scene = MOVE(c.scene);
+			tile.state = Resident;
+			tile.lastUse = frame;
+			residentBytes += (size_t) index.tiles[c.tileIdx].size;
+		}
+		else
+		{
+			tile.state = Failed;
+			failures.push_back( "tile " + std::to_string(c.tileIdx) + ": " + c.error );
+		}
+	}
+	completed.clear();
+
+	// drop stale requests, reissue in order of distance
+	for (auto r : requests)
+		tiles[r].state = Unloaded;
+	requests.clear();
+
+	size_t desiredBytes = 0;
+	size_t pendingBytes = 0;
+	for (auto i : order)
+	{
+		if (tiles[i].state == Failed)
+			continue;
+
+		auto tileBytes = (size_t) index.tiles[i].size;
+		// smaller tiles further out may still fit
+		if (desiredBytes + tileBytes > byteBudget)
+			continue;
+		desiredBytes += tileBytes;
+
+		auto& tile = tiles[i];
+		tile.lastUse = frame;
+		if (tile.state == Unloaded)
+		{
+			tile.state = Queued;
+			requests.push_back(i);
+		}
+		if (tile.state == Queued)
+			pendingBytes += tileBytes;
+	}
+
+	// make room, least recently used first
+	while (residentBytes + pendingBytes > byteBudget)
+	{
+		Tile* lru = nullptr;
+		size_t lruIdx = 0;
+		for (size_t i = 0; i < tiles.size(); ++i)
+			if (tiles[i].state == Resident && tiles[i].lastUse != frame && (!lru || tiles[i].lastUse < lru->lastUse))
+			{
+				lru = &tiles[i];
+				lruIdx = i;
+			}
+		if (!lru)
+			break;
+
+		lru->scene.reset();
+		lru->state = Unloaded;
+		residentBytes -= (size_t) index.tiles[lruIdx].size;
+	}
+
+	if (!requests.empty())
+		wakeLoader.notify_one();
+	lock.unlock();
+
+	// report outside the lock, handlers may throw
+	for (auto& f : failures)
+		errorHandler("tile", f.c_str());
+}
+
+} // namespace
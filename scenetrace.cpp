@@ -0,0 +1,322 @@
+#include "scenetrace"
+#include "scenelights"
+#include "parallel"
+
+#include <atomic>
+#include <cfloat>
+
+namespace scene
+{
+
+namespace
+{
+	typedef math::vec<float, 3> vec3;
+	typedef math::vec<float, 4> vec4;
+
+	float luminance(vec3 const& c)
+	{
+		return dot(c, vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+
+	vec3 fresnel_schlick(vec3 const& f0, float cosTheta)
+	{
+		float m = math::max(0.0f, 1.0f - cosTheta);
+		float m5 = (m * m) * (m * m) * m;
+		return f0 + (vec3(1.0f) - f0) * m5;
+	}
+
+	// Phong lobe around the given mirror direction, pdf proportional to cos^exponent
+	vec3 sample_phong_lobe(vec3 const& mirror, float exponent, float u1, float u2)
+	{
+		float cosA = pow(u1, 1.0f / (exponent + 1.0f));
+		float sinA = sqrt(math::max(0.0f, 1.0f - cosA * cosA));
+		float phi = 6.28318531f * u2;
+		vec3 t, b;
+		make_frame(mirror, t, b);
+		return sinA * cos(phi) * t + sinA * sin(phi) * b + cosA * mirror;
+	}
+
+	bool is_finite(vec3 const& v)
+	{
+		return std::isfinite(v.x) && std::isfinite(v.y) && std::isfinite(v.z);
+	}
+
+	enum Lobe { Diffuse, Glossy, Mirror, Transmission, LobeCount };
+
+} // namespace
+
+TraceAccumulator::TraceAccumulator(glm::uvec2 resolution)
+	: passes(0)
+{
+	img::ImageDesc desc;
+	desc.channels = 4;
+	desc.dim = glm::uvec3(resolution, 1);
+	sums = img::Image<float>(desc);
+}
+
+void TraceAccumulator::reset()
+{
+	std::fill(sums.pixels.begin(), sums.pixels.end(), 0.0f);
+	passes = 0;
+}
+
+img::Image<float> TraceAccumulator::resolve() const
+{
+	img::Image<float> image(static_cast<img::ImageDesc const&>(sums));
+	for (size_t i = 0, ie = sums.pixels.size(); i + 4 <= ie; i += 4)
+	{
+		float n = sums.pixels[i + 3];
+		float w = (n > 0.0f) ? 1.0f / n : 0.0f;
+		image.pixels[i] = sums.pixels[i] * w;
+		image.pixels[i + 1] = sums.pixels[i + 1] * w;
+		image.pixels[i + 2] = sums.pixels[i + 2] * w;
+		image.pixels[i + 3] = (n > 0.0f) ? 1.0f : 0.0f;
+	}
+	return image;
+}
+
+template <class Scene>
+vec3 trace_path(Scene const& scene, TriangleBvh const& bvh, math::ray<vec3> const& cameraRay, TraceParams const& params, SampleRandom& random)
+{
+	vec3 L(0.0f), throughput(1.0f);
+	auto ray = cameraRay;
+	bool lights = !scene.lightNodes.empty();
+	// emission already gathered by next-event estimation is not counted again when hit
+	bool countEmission = true;
+
+	for (unsigned bounce = 0; ; ++bounce)
+	{
+		BvhHit hit;
+		if (!bvh.intersect(ray, FLT_MAX, hit))
+		{
+			L += throughput * params.skyRadiance;
+			break;
+		}
+
+		auto surface = surface_point(scene, bvh, ray, hit);
+		auto& material = surface_material(scene, surface);
+		if (countEmission)
+			L += throughput * material.emissive;
+		if (bounce >= params.maxBounces)
+			break;
+
+		auto& tri = bvh.triangles[hit.triangle];
+		bool entering = dot(cross(tri.e1, tri.e2), ray.d) < 0.0f;
+		vec3 n = surface.shadingNormal;
+		float cosO = math::max(0.0f, -dot(ray.d, n));
+
+		// layered model: Fresnel mirror coat (reflectivity) over glossy (specular, shininess),
+		// transmitted (filter, refract) & diffuse base
+		vec3 F = fresnel_schlick(material.reflectivity, cosO);
+		vec3 base = vec3(1.0f) - F;
+		// each layer only receives the energy not taken by the layers above it
+		vec3 under = base * (vec3(1.0f) - material.specular);
+		vec3 weights[LobeCount];
+		weights[Diffuse] = under * (vec3(1.0f) - material.filter) * material.diffuse;
+		weights[Glossy] = base * material.specular;
+		weights[Mirror] = F;
+		weights[Transmission] = under * material.filter;
+
+		float probs[LobeCount], probSum = 0.0f;
+		for (int i = 0; i < LobeCount; ++i)
+			probSum += probs[i] = math::max(0.0f, luminance(weights[i]));
+		if (!(probSum > 0.0f))
+			break;
+
+		float select = random.uniform() * probSum;
+		int lobe = 0;
+		while (lobe < LobeCount - 1 && (select >= probs[lobe] || probs[lobe] == 0.0f))
+			select -= probs[lobe++];
+		throughput *= weights[lobe] * (probSum / probs[lobe]);
+
+		float u1 = random.uniform(), u2 = random.uniform();
+		vec3 offsetNormal = surface.normal;
+		countEmission = !lights || lobe != Diffuse;
+		switch (lobe)
+		{
+		case Diffuse:
+			if (lights)
+				L += throughput * sample_direct_light(scene, bvh, surface.position, n, params.rayOffset, random);
+			ray.d = sample_cosine_hemisphere(n, u1, u2);
+			break;
+		case Glossy:
+		{
+			float exponent = math::max(material.shininess.x, 0.0f);
+			ray.d = sample_phong_lobe(reflect(ray.d, n), exponent, u1, u2);
+			// modified Phong, normalized BRDF over the sampled lobe
+			throughput *= math::max(0.0f, dot(ray.d, n)) * (exponent + 2.0f) / (exponent + 1.0f);
+			break;
+		}
+		case Mirror:
+			ray.d = reflect(ray.d, n);
+			break;
+		case Transmission:
+		{
+			float ior = (material.refract.x > 0.0f) ? material.refract.x : 1.0f;
+			float eta = (entering) ? 1.0f / ior : ior;
+			float k = 1.0f - eta * eta * (1.0f - cosO * cosO);
+			if (k < 0.0f)
+				ray.d = reflect(ray.d, n); // total internal reflection
+			else
+			{
+				ray.d = normalize(eta * ray.d + (eta * cosO - sqrt(k)) * n);
+				offsetNormal = -offsetNormal;
+			}
+			break;
+		}
+		}
+
+		// directions on the wrong side of the geometric surface carry no light
+		if (dot(ray.d, offsetNormal) <= 0.0f)
+			break;
+		ray.o = surface.position + params.rayOffset * offsetNormal;
+
+		// Russian roulette once paths have lost most of their contribution
+		if (bounce >= 3)
+		{
+			float q = math::min(0.95f, math::max(throughput.x, math::max(throughput.y, throughput.z)));
+			if (random.uniform() >= q)
+				break;
+			throughput /= q;
+		}
+	}
+
+	return L;
+}
+
+template <class Scene>
+void trace_tile(Scene const& scene, TriangleBvh const& bvh, math::mat4 const& viewProjInverse, glm::uvec2 resolution
+	, glm::uvec2 begin, glm::uvec2 end, unsigned long long pass, TraceParams const& params, float* sums, size_t rowStride)
+{
+	unsigned long long pixelCount = (unsigned long long) resolution.x * resolution.y;
+	for (unsigned y = begin.y; y < end.y; ++y)
+		for (unsigned x = begin.x; x < end.x; ++x)
+		{
+			size_t idx = size_t(y) * resolution.x + x;
+			SampleRandom random(params.seed * 0x100000001B3ULL + pass * pixelCount + idx);
+
+			// jittered within the pixel, viewportCoords() adds the half-pixel offset
+			auto pixel = glm::vec2(float(x) + random.uniform() - 0.5f, float(y) + random.uniform() - 0.5f);
+			auto ray = math::rayFromVPI(math::viewportCoords(pixel, glm::ivec2(resolution)), viewProjInverse);
+			vec3 L = trace_path(scene, bvh, ray, params, random);
+			if (!is_finite(L))
+				continue;
+			if (params.clampRadiance > 0.0f)
+				L = min(L, vec3(params.clampRadiance));
+
+			float* sum = sums + 4 * ((y - begin.y) * rowStride + (x - begin.x));
+			sum[0] += L.x;
+			sum[1] += L.y;
+			sum[2] += L.z;
+			sum[3] += 1.0f;
+		}
+}
+
+template <class Scene>
+bool trace_pass(Scene const& scene, TriangleBvh const& bvh, math::mat4 const& viewProjInverse, TraceAccumulator& accum
+	, TraceParams const& params, trace_deadline deadline)
+{
+	auto res = accum.resolution();
+	unsigned tileSize = math::max(params.tileSize, 1U);
+	unsigned tilesX = (res.x + tileSize - 1) / tileSize, tilesY = (res.y + tileSize - 1) / tileSize;
+	unsigned long long pass = accum.passes++;
+
+	std::atomic<bool> incomplete(false);
+	stdx::parallel_for(size_t(tilesX) * tilesY, 1, [&](size_t begin, size_t end)
+	{
+		for (size_t tile = begin; tile < end; ++tile)
+		{
+			if (deadline != trace_deadline::max() && std::chrono::steady_clock::now() >= deadline)
+			{
+				incomplete = true;
+				continue;
+			}
+
+			auto tileBegin = glm::uvec2(unsigned(tile % tilesX), unsigned(tile / tilesX)) * tileSize;
+			auto tileEnd = min(tileBegin + tileSize, res);
+			trace_tile(scene, bvh, viewProjInverse, res, tileBegin, tileEnd, pass, params
+				, &accum.sums.pixels[4 * (size_t(tileBegin.y) * res.x + tileBegin.x)], res.x);
+		}
+	}, params.maxThreads);
+
+	return !incomplete;
+}
+
+template <class Scene>
+unsigned trace_progressive(Scene const& scene, TriangleBvh const& bvh, math::mat4 const& viewProjInverse, TraceAccumulator& accum
+	, double seconds, unsigned maxPasses, TraceParams const& params)
+{
+	auto deadline = trace_deadline::max();
+	if (seconds > 0.0)
+		deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+
+	unsigned completed = 0;
+	for (; completed < maxPasses; ++completed)
+	{
+		// the first pass always completes, such that every pixel has a sample
+		if (!trace_pass(scene, bvh, viewProjInverse, accum, params, (accum.passes == 0) ? trace_deadline::max() : deadline))
+			break;
+		if (std::chrono::steady_clock::now() >= deadline)
+		{
+			++completed;
+			break;
+		}
+	}
+	return completed;
+}
+
+template <class Scene>
+img::Image<float> render_image(Scene const& scene, TriangleBvh const& bvh, math::mat4 const& viewProjInverse, glm::uvec2 resolution
+	, unsigned samples, double seconds, TraceParams const& params)
+{
+	TraceAccumulator accum(resolution);
+	trace_progressive(scene, bvh, viewProjInverse, accum, seconds, samples, params);
+	return accum.resolve();
+}
+
+#define SCENE_TRACE_INSTANTIATE(Scene) \
+	template vec3 trace_path(Scene const& scene, TriangleBvh const& bvh, math::ray<vec3> const& cameraRay, TraceParams const& params, SampleRandom& random); \
+	template void trace_tile(Scene const& scene, TriangleBvh const& bvh, math::mat4 const& viewProjInverse, glm::uvec2 resolution \
+		, glm::uvec2 begin, glm::uvec2 end, unsigned long long pass, TraceParams const& params, float* sums, size_t rowStride); \
+	template bool trace_pass(Scene const& scene, TriangleBvh const& bvh, math::mat4 const& viewProjInverse, TraceAccumulator& accum \
+		, TraceParams const& params, trace_deadline deadline); \
+	template unsigned trace_progressive(Scene const& scene, TriangleBvh const& bvh, math::mat4 const& viewProjInverse, TraceAccumulator& accum \
+		, double seconds, unsigned maxPasses, TraceParams const& params); \
+	template img::Image<float> render_image(Scene const& scene, TriangleBvh const& bvh, math::mat4 const& viewProjInverse, glm::uvec2 resolution \
+		, unsigned samples, double seconds, TraceParams const& params);
+
+SCENE_TRACE_INSTANTIATE(Scene)
+SCENE_TRACE_INSTANTIATE(ExternalScene)
+
+#undef SCENE_TRACE_INSTANTIATE
+
+math::mat4 frame_bounds(math::aabb<vec3> const& bounds, float aspect, vec3 const& viewDir, float fovy)
+{
+	vec3 center(0.0f);
+	float radius = 1.0f;
+	if (bounds.min.x <= bounds.max.x)
+	{
+		center = 0.5f * (bounds.min + bounds.max);
+		radius = math::max(0.5f * length(bounds.max - bounds.min), 1.0e-6f);
+	}
+
+	// fit the bounding sphere into the narrower field of view
+	float fovx = 2.0f * atan(aspect * tan(0.5f * fovy));
+	float dist = radius / sin(0.5f * math::min(fovy, fovx));
+
+	vec3 forward = normalize(viewDir);
+	vec3 up = (fabs(forward.y) < 0.999f) ? vec3(0.0f, 1.0f, 0.0f) : vec3(0.0f, 0.0f, 1.0f);
+	vec3 right = normalize(cross(forward, up));
+	up = cross(right, forward);
+
+	math::mat4 viewInverse;
+	viewInverse.a = vec4(right, 0.0f);
+	viewInverse.b = vec4(up, 0.0f);
+	viewInverse.c = vec4(-forward, 0.0f);
+	viewInverse.d = vec4(center - dist * forward, 1.0f);
+
+	auto proj = math::perspective(fovy, aspect, math::max(dist - radius, 1.0e-3f * dist), dist + radius);
+	return viewInverse * inverse(proj);
+}
+
+} // namespace